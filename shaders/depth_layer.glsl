@@ -0,0 +1,16 @@
+#version 330
+// fragment shader for drawing one layer of a depth texture
+// array (e.g. a shadow cascade) onto a full-screen quad
+
+in vec4 var_Color;
+in vec3 var_Normal;
+in vec3 var_Position;
+
+uniform sampler2DArray depthTex;
+uniform int layer;
+
+layout(location=0) out vec4 out_Color;
+void main () {
+    float depth = texture(depthTex, vec3(var_Color.xy, layer)).r;
+    out_Color = vec4(depth, depth, depth, 1);
+}
@@ -0,0 +1,6 @@
+#version 330
+// fragment shader for depth-only passes.
+// there are no color outputs; only depth is written.
+
+void main() {
+}
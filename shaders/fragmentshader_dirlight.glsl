@@ -1,27 +1,110 @@
 #version 330
 // fragment shader for phong-model lighting with a single directional light source.
 
+// PCF kernel of the depth compare. the program is built once per kernel
+// with PCF_KERNEL defined (see loadPrograms()); must match PCF_* in main.h
+#define PCF_GRID_1 0  // n x n bilinear compares one texel apart
+#define PCF_GRID_4 1
+#define PCF_GRID_9 2
+#define PCF_GRID_16 3
+#define PCF_GRID_25 4
+#define PCF_POISSON 5 // 16 compares on a rotated disk
+#define PCF_GATHER 6  // footprint of PCF_GRID_9 in four gathers
+#define PCF_PCSS 7    // penumbra from the blocker distance
+#ifndef PCF_KERNEL
+#define PCF_KERNEL PCF_GRID_1
+#endif
+
+#if PCF_KERNEL == PCF_GATHER
+#extension GL_ARB_gpu_shader5 : enable
+#ifndef GL_ARB_gpu_shader5
+#define PCF_GRID 3 // no compare gathers, same footprint in single taps
+#endif
+#elif PCF_KERNEL <= PCF_GRID_25
+#define PCF_GRID (PCF_KERNEL + 1)
+#endif
+
 in vec4 var_Color;
 in vec3 var_Normal;
 in vec3 var_Position;
 
-uniform vec3 camPos;
+// same block as in vertexshader.glsl
+#define MAX_CASCADES 4
+layout(std140) uniform FrameConstants {
+    mat4 V;
+    mat4 P;
+    mat4 light_VP[MAX_CASCADES]; // light view-projection per cascade
+    vec4 cascadeSplits; // far end of each cascade along the view axis
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightDiff;
+    int cascadeCount;
+};
+
+// material table of the scene, uploaded once after loading. larger
+// scenes bind the page of MAX_MATERIALS that holds materialIndex.
+// must match materialconstants in main.cpp
+#define MAX_MATERIALS 256
+struct Material {
+    vec4 diffuse;  // rgb, alpha
+    vec4 ambient;  // rgb
+    vec4 specular; // rgb, shininess
+};
+layout(std140) uniform Materials {
+    Material materials[MAX_MATERIALS];
+};
+uniform int materialIndex;
 
-uniform vec3 diffColor;
-uniform vec3 specColor;
-uniform vec3 ambientColor;
-uniform float shininess;
-uniform float alpha;
 uniform sampler2D diffuseTex;
-uniform sampler2D shadowTex;
-uniform mat4 light_VP;
+// one layer per cascade. depth compares happen in the sampler, and
+// a single lookup already filters 2 x 2 compares bilinearly
+uniform sampler2DArrayShadow shadowTex;
+uniform sampler2DArray momentTex; // blurred depth moments per cascade
+// for PCSS: the shadow map without depth compares, and the min/max
+// depths of 2 x 2 texels per texel at level 0, of 2 x 2 texels of the
+// level below at every further level
+uniform sampler2DArray shadowDepthTex;
+uniform sampler2DArray pyramidTex;
+uniform float lightTanAngle; // angular radius of the light
+// depth pass of the camera, for contact shadows. they march rays of
+// contactLength towards the light; 0 turns them off
+uniform sampler2D sceneDepthTex;
+uniform float contactLength;
+
+// spot and point lights, with shadow views in one atlas.
+// must match locallightconstants in main.cpp
+#define MAX_LOCAL_LIGHTS 32
+#define MAX_LOCAL_VIEWS 128
+struct LocalLight {
+    vec4 position;  // xyz, range
+    vec4 direction; // xyz, cosine of the spot cone; -1 for point lights
+    vec4 color;     // rgb, tangent of half the field of view of its views
+    ivec4 shadow;   // first view, number of views (0, 1 or 6)
+};
+layout(std140) uniform LocalLights {
+    LocalLight localLights[MAX_LOCAL_LIGHTS];
+    mat4 localVP[MAX_LOCAL_VIEWS];
+    vec4 localTiles[MAX_LOCAL_VIEWS]; // atlas offset xy and scale zw; zw = 0 without a tile
+    int localLightCount;
+};
+uniform sampler2DArrayShadow atlasTex;
 
-uniform vec3 lightPos;
-uniform vec3 lightDiff;
+// must match SHADOW_FILTER_* in shadowmap.h
+#define SHADOW_FILTER_VSM 1
+#define SHADOW_FILTER_EVSM 2
+uniform int shadowFilter;
+// part of the lit range that counts as shadow, which cuts off light
+// leaking through where several occluders overlap
+uniform float lightBleed;
+uniform float evsmExponent; // same as in shadow_moments.glsl
 
 layout(location=0) out vec4 out_Color;
 
 vec4 blinn_phong(vec3 kd) {
+    vec3 specColor = materials[materialIndex].specular.rgb;
+    float shininess = materials[materialIndex].specular.w;
+    float alpha = materials[materialIndex].diffuse.w;
+
     // Implement Blinn-Phong Shading Model
     // 1. Convert everything to world space
     //    and normalize directions
@@ -46,26 +129,342 @@ vec4 blinn_phong(vec3 kd) {
     return vec4(diffContrib + specContrib, alpha);
 }
 
-void main () {
-    vec3 kd = texture(diffuseTex, var_Color.xy).xyz;
-    
-    vec4 pos_world = vec4(var_Position, 1);
-    //pos_world /= pos_world.w;
+// index of the cascade that covers the fragment
+int select_cascade(vec3 pos_world) {
+    float depth = -(V * vec4(pos_world, 1)).z;
+    int cascade = 0;
+    while (cascade < cascadeCount - 1 && depth > cascadeSplits[cascade]) {
+        cascade++;
+    }
+    return cascade;
+}
+
+// upper bound of the light reaching depth t (chebyshev's inequality),
+// from the mean and mean square of the occluder depths around it
+float chebyshev(vec2 moments, float t, float minvariance) {
+    if (t <= moments.x) {
+        return 1.0;
+    }
+    float variance = max(moments.y - moments.x * moments.x, minvariance);
+    float d = t - moments.x;
+    float p = variance / (variance + d * d);
+    return clamp((p - lightBleed) / (1.0 - lightBleed), 0.0, 1.0);
+}
 
-    vec4 positionProjected = light_VP * (vec4(lightPos, 1) + -pos_world); //* vec4(lightPos, 0);
-    positionProjected = (positionProjected * 0.5) + vec4( .5, .5, .5, 0);
-    
-    
-    float depth1 = positionProjected.z;
-    vec3 kp = texture(shadowTex, positionProjected.xy).xyz;
-    float newDepth = kp.z;
+// duvdx, duvdy: screen derivatives of uvz.xy, which pick the mip level
+float moment_visibility(vec3 uvz, int cascade, vec2 duvdx, vec2 duvdy) {
+    vec4 moments = textureGrad(momentTex, vec3(uvz.xy, cascade), duvdx, duvdy);
+    if (shadowFilter == SHADOW_FILTER_EVSM) {
+        float d = 2.0 * uvz.z - 1.0;
+        float pos = exp(evsmExponent * d);
+        float neg = -exp(-evsmExponent * d);
+        // scale the minimum variance with the slope of the warp
+        float pos_min = 0.0001 * evsmExponent * pos;
+        float neg_min = 0.0001 * evsmExponent * neg;
+        return min(chebyshev(moments.xy, pos, pos_min * pos_min),
+                   chebyshev(moments.zw, neg, neg_min * neg_min));
+    }
+    return chebyshev(moments.xy, uvz.z, 0.00002);
+}
 
-    if( (newDepth + 0.001) < depth1) {
-        // shadow
-        out_Color = vec4(ambientColor, 1) + blinn_phong(kd) - vec4(kp.x, kp.x, kp.x, 1);
+// 0..1, different for neighboring pixels (interleaved gradient noise)
+float pixel_noise() {
+    return fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+}
+
+#if PCF_KERNEL == PCF_POISSON || PCF_KERNEL == PCF_PCSS
+const vec2 POISSON_DISK[16] = vec2[](
+    vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+    vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+    vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+    vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+    vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+    vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+    vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+    vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790));
+
+// turns the disk per pixel, which trades the banding
+// of a fixed pattern for noise
+mat2 disk_rotation() {
+    float angle = 6.283185 * pixel_noise();
+    return mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+}
+
+// compares on the disk of the given radius around uvz
+float pcf_disk(vec3 uvz, int cascade, float ref, float radius) {
+    mat2 rotation = disk_rotation();
+    float lit = 0.0;
+    for (int i = 0; i < 16; ++i) {
+        vec2 uv = uvz.xy + rotation * POISSON_DISK[i] * radius;
+        lit += texture(shadowTex, vec4(uv, cascade, ref));
+    }
+    return lit / 16.0;
+}
+#endif
+
+#ifdef PCF_GRID
+float pcf(vec3 uvz, int cascade, float ref) {
+    vec2 texel = 1.0 / vec2(textureSize(shadowTex, 0).xy);
+    float offset = 0.5 * float(PCF_GRID - 1);
+    float lit = 0.0;
+    for (int y = 0; y < PCF_GRID; ++y) {
+        for (int x = 0; x < PCF_GRID; ++x) {
+            vec2 uv = uvz.xy + (vec2(x, y) - offset) * texel;
+            lit += texture(shadowTex, vec4(uv, cascade, ref));
+        }
+    }
+    return lit / float(PCF_GRID * PCF_GRID);
+}
+#elif PCF_KERNEL == PCF_POISSON
+float pcf(vec3 uvz, int cascade, float ref) {
+    return pcf_disk(uvz, cascade, ref, 2.0 / float(textureSize(shadowTex, 0).x));
+}
+#elif PCF_KERNEL == PCF_PCSS
+// min and max depth within radius texels around uv, from 2 x 2 texels
+// of the coarsest pyramid level that still has to be read
+vec2 depth_range(vec2 uv, int cascade, float radius) {
+    ivec2 size0 = textureSize(pyramidTex, 0).xy;
+    int top = int(log2(float(size0.x)));
+    // 2 x 2 texels reach at least half a texel to each side,
+    // a texel of level L is 2^(L + 1) shadow map texels wide
+    int level = clamp(int(ceil(log2(max(radius, 1.0)))), 0, top);
+    ivec2 size = max(size0 >> level, ivec2(1));
+    ivec2 texel = ivec2(floor(uv * vec2(size) - 0.5));
+    vec2 range = vec2(1.0, 0.0);
+    for (int i = 0; i < 4; ++i) {
+        ivec2 t = clamp(texel + ivec2(i & 1, i >> 1), ivec2(0), size - 1);
+        vec2 r = texelFetch(pyramidTex, ivec3(t, cascade), level).rg;
+        range = vec2(min(range.x, r.x), max(range.y, r.y));
+    }
+    return range;
+}
+
+// percentage-closer soft shadows: the penumbra widens with the
+// distance between receiver and blockers, as for a light of
+// lightTanAngle angular radius
+float pcf(vec3 uvz, int cascade, float ref) {
+    float size = float(textureSize(shadowTex, 0).x);
+    // uv offset of the penumbra edge per unit of depth in the map
+    mat4 VP = light_VP[cascade];
+    float xyscale = length(vec3(VP[0][0], VP[1][0], VP[2][0]));
+    float zscale = length(vec3(VP[0][2], VP[1][2], VP[2][2]));
+    float spread = lightTanAngle * xyscale / zscale;
+
+    // blockers can only be as far out as one at depth 0 would throw
+    // its penumbra. the pyramid tells if the whole area is in front
+    // of the receiver or behind it, which settles most pixels.
+    vec2 range = depth_range(uvz.xy, cascade, spread * ref * size);
+    if (ref <= range.x) {
+        return 1.0;
+    }
+    if (ref > range.y) {
+        return 0.0;
     }
-    else {
-        // illuminated
-        out_Color = vec4(ambientColor + blinn_phong(kd).xyz , 1);
+
+    // mean depth of the blockers, searched within the reach of the
+    // nearest one
+    float search = spread * (ref - range.x);
+    mat2 rotation = disk_rotation();
+    float blockers = 0.0;
+    float count = 0.0;
+    for (int i = 0; i < 16; ++i) {
+        vec2 uv = uvz.xy + rotation * POISSON_DISK[i] * search;
+        float depth = texture(shadowDepthTex, vec3(uv, cascade)).r;
+        if (depth < ref) {
+            blockers += depth;
+            count += 1.0;
+        }
+    }
+    if (count == 0.0) {
+        return 1.0;
+    }
+    float penumbra = spread * (ref - blockers / count);
+    return pcf_disk(uvz, cascade, ref, max(penumbra, 1.0 / size));
+}
+#else
+// compares of 2 x 2 texels, weighted by wx (left, right) and wy (bottom, top)
+float gather_weighted(vec2 uv, int cascade, float ref, vec2 wx, vec2 wy) {
+    vec4 lit = textureGather(shadowTex, vec3(uv, cascade), ref);
+    return dot(lit, vec4(wx.x * wy.y, wx.y * wy.y, wx.y * wy.x, wx.x * wy.x));
+}
+
+// the 4 x 4 texels around uvz, weighted like the nine bilinear taps
+// of PCF_GRID_9: (1 - f, 1, 1, f) along each axis
+float pcf(vec3 uvz, int cascade, float ref) {
+    vec2 size = vec2(textureSize(shadowTex, 0).xy);
+    vec2 pos = uvz.xy * size - 0.5;
+    vec2 f = fract(pos);
+    // corners between texels, each in the middle of a 2 x 2 block
+    vec2 uv = floor(pos) / size;
+    vec2 step = 2.0 / size;
+    float lit = gather_weighted(uv, cascade, ref, vec2(1.0 - f.x, 1.0), vec2(1.0 - f.y, 1.0)) +
+        gather_weighted(uv + vec2(step.x, 0), cascade, ref, vec2(1.0, f.x), vec2(1.0 - f.y, 1.0)) +
+        gather_weighted(uv + vec2(0, step.y), cascade, ref, vec2(1.0 - f.x, 1.0), vec2(1.0, f.y)) +
+        gather_weighted(uv + step, cascade, ref, vec2(1.0, f.x), vec2(1.0, f.y));
+    return lit / 9.0;
+}
+#endif
+
+// 1 if the fragment is lit, 0 if it is in shadow.
+// the filterable modes give fractions in between.
+float shadow_visibility(vec3 pos_world, vec3 normal_world) {
+    // implicit derivatives are undefined in the branches below and jump
+    // where neighboring pixels pick different cascades. the screen
+    // derivatives of the position are taken here and carried over to
+    // the lookup of each cascade instead.
+    vec3 dpdx = dFdx(pos_world);
+    vec3 dpdy = dFdy(pos_world);
+
+    // a layer whose refresh is postponed may not reach the fragment
+    // yet (see ShadowCache); the next cascade covers more and takes over
+    for (int cascade = select_cascade(pos_world); cascade < cascadeCount; ++cascade) {
+        // push the lookup out along the normal by about a texel of the
+        // cascade, which avoids acne without detaching shadows. texels
+        // of a warped map shrink towards the camera, so their size is
+        // measured at the fragment: d(ndc)/d(pos) is (row - ndc * row3) / w.
+        mat4 VP = light_VP[cascade];
+        vec4 clip = VP * vec4(pos_world, 1);
+        if (clip.w <= 0.0) {
+            return 1.0;
+        }
+        vec3 row3 = vec3(VP[0][3], VP[1][3], VP[2][3]);
+        vec3 gradx = vec3(VP[0][0], VP[1][0], VP[2][0]) - clip.x / clip.w * row3;
+        vec3 grady = vec3(VP[0][1], VP[1][1], VP[2][1]) - clip.y / clip.w * row3;
+        float scale = min(length(gradx), length(grady)) / clip.w;
+        float texel = 2.0 / (scale * textureSize(shadowTex, 0).x);
+        vec3 offset_pos = pos_world + normal_world * (1.5 * texel);
+
+        vec4 pos_light = VP * vec4(offset_pos, 1);
+        vec3 uvz = pos_light.xyz / pos_light.w * 0.5 + 0.5;
+        if (any(lessThan(uvz.xy, vec2(0.0))) || any(greaterThan(uvz.xy, vec2(1.0)))) {
+            continue;
+        }
+        if (uvz.z > 1.0) {
+            // behind the far plane of the light, nothing can cast a shadow
+            return 1.0;
+        }
+        if (shadowFilter == SHADOW_FILTER_VSM || shadowFilter == SHADOW_FILTER_EVSM) {
+            // d(uv)/d(pos) is half of d(ndc)/d(pos)
+            vec2 duvdx = vec2(dot(gradx, dpdx), dot(grady, dpdx)) * (0.5 / clip.w);
+            vec2 duvdy = vec2(dot(gradx, dpdy), dot(grady, dpdy)) * (0.5 / clip.w);
+            return moment_visibility(uvz, cascade, duvdx, duvdy);
+        }
+        return pcf(uvz, cascade, uvz.z - 0.0005);
+    }
+    // outside of every layer
+    return 1.0;
+}
+
+// 1 if the fragment is lit by local light i, 0 if it is in shadow
+float local_shadow(int i, vec3 pos_world, vec3 normal_world) {
+    ivec4 shadow = localLights[i].shadow;
+    if (shadow.y == 0) {
+        return 1.0;
+    }
+    vec3 d = pos_world - localLights[i].position.xyz;
+    int view = shadow.x;
+    if (shadow.y == 6) {
+        // cube face along the major axis, see localLightView()
+        vec3 a = abs(d);
+        if (a.x >= a.y && a.x >= a.z) {
+            view += d.x > 0.0 ? 0 : 1;
+        }
+        else if (a.y >= a.z) {
+            view += d.y > 0.0 ? 2 : 3;
+        }
+        else {
+            view += d.z > 0.0 ? 4 : 5;
+        }
+    }
+    vec4 tile = localTiles[view];
+    if (tile.z == 0.0) {
+        return 1.0;
+    }
+    // texels grow with the distance from the light, and so does the
+    // normal offset against acne
+    float atlassize = float(textureSize(atlasTex, 0).x);
+    float texel = 2.0 * length(d) * localLights[i].color.w / (tile.z * atlassize);
+    vec4 pos_light = localVP[view] * vec4(pos_world + normal_world * (1.5 * texel), 1);
+    vec3 uvz = pos_light.xyz / pos_light.w * 0.5 + 0.5;
+    if (any(lessThan(uvz, vec3(0.0))) || any(greaterThan(uvz, vec3(1.0)))) {
+        return 1.0;
+    }
+    // stay half a texel inside, the filter must not reach other tiles
+    vec2 margin = vec2(0.5 / (tile.z * atlassize));
+    vec2 uv = tile.xy + clamp(uvz.xy, margin, 1.0 - margin) * tile.zw;
+    return texture(atlasTex, vec4(uv, 0, uvz.z - 0.0001));
+}
+
+// diffuse light of all local lights
+vec3 local_lighting(vec3 kd, vec3 pos_world, vec3 normal_world) {
+    vec3 sum = vec3(0);
+    for (int i = 0; i < localLightCount; ++i) {
+        vec3 L = localLights[i].position.xyz - pos_world;
+        float dist = length(L);
+        float range = localLights[i].position.w;
+        if (dist >= range) {
+            continue;
+        }
+        L /= dist;
+        // smooth falloff that reaches 0 at the range
+        float window = 1.0 - (dist * dist) / (range * range);
+        float falloff = window * window;
+        float cone = localLights[i].direction.w;
+        float spot = cone > -1.0 ?
+            smoothstep(cone, mix(cone, 1.0, 0.2), dot(-L, localLights[i].direction.xyz)) : 1.0;
+        float ndotl = max(dot(normal_world, L), 0.0);
+        if (ndotl * spot <= 0.0) {
+            continue;
+        }
+        float lit = local_shadow(i, pos_world, normal_world);
+        sum += localLights[i].color.rgb * kd * (ndotl * spot * falloff * lit);
+    }
+    return sum;
+}
+
+// screen-space contact shadows: 0 if the depth pass of the camera has
+// a surface between the fragment and the light within contactLength.
+// catches the contacts of details finer than a shadow map texel. the
+// depth buffer has no thickness, so every surface counts as
+// contactLength thick; rays that leave the screen find nothing.
+float contact_shadow(vec3 pos_world, vec3 normal_world) {
+    const int STEPS = 16;
+    vec3 light_dir = normalize(lightPos);
+    if (contactLength <= 0.0 || dot(normal_world, light_dir) <= 0.0) {
+        return 1.0;
+    }
+    vec3 step = (V * vec4(light_dir, 0)).xyz * (contactLength / float(STEPS));
+    // start off the surface and jitter the steps, which turns their
+    // banding into noise
+    vec3 pos = (V * vec4(pos_world + normal_world * (0.02 * contactLength), 1)).xyz +
+        step * pixel_noise();
+    for (int i = 0; i < STEPS; ++i) {
+        pos += step;
+        vec4 clip = P * vec4(pos, 1);
+        vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+        if (any(lessThan(uv, vec2(0))) || any(greaterThan(uv, vec2(1)))) {
+            break;
+        }
+        // view distance of the surface in the buffer
+        float depth = texture(sceneDepthTex, uv).r;
+        float surface = P[3][2] / (2.0 * depth - 1.0 + P[2][2]);
+        float behind = -pos.z - surface;
+        if (behind > 0.002 * surface && behind < contactLength) {
+            return 0.0;
+        }
+    }
+    return 1.0;
+}
+
+void main () {
+    vec3 kd = texture(diffuseTex, var_Color.xy).xyz;
+    vec3 ambientColor = materials[materialIndex].ambient.rgb;
+
+    // shadowed fragments only keep their ambient term
+    float visibility = shadow_visibility(var_Position, normalize(var_Normal));
+    if (visibility > 0.0) {
+        visibility = min(visibility, contact_shadow(var_Position, normalize(var_Normal)));
     }
+    vec3 local = local_lighting(kd, var_Position, normalize(var_Normal));
+    out_Color = vec4(ambientColor + visibility * blinn_phong(kd).xyz + local, 1);
 }
@@ -0,0 +1,36 @@
+#version 330
+// geometry shader for the layered shadow pass. every triangle is
+// emitted once per scheduled cascade, into the matching layer of the
+// shadow map.
+#define MAX_CASCADES 4
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 12) out; // 3 * MAX_CASCADES
+
+// same block as in vertexshader.glsl
+layout(std140) uniform FrameConstants {
+    mat4 V;
+    mat4 P;
+    mat4 light_VP[MAX_CASCADES]; // light view-projection per cascade
+    vec4 cascadeSplits; // far end of each cascade along the view axis
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightDiff;
+    int cascadeCount;
+};
+
+// bit i set: cascade i is rendered this frame
+uniform int layerMask;
+
+void main () {
+    for (int layer = 0; layer < cascadeCount; ++layer) {
+        if ((layerMask & (1 << layer)) == 0) {
+            continue;
+        }
+        for (int i = 0; i < 3; ++i) {
+            gl_Layer = layer;
+            gl_Position = light_VP[layer] * gl_in[i].gl_Position;
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
@@ -0,0 +1,51 @@
+#version 330
+// fragment shader that builds one level of the min/max depth pyramid
+// of a shadow map layer, drawn on a full-screen quad. level 0 reduces
+// 2 x 2 depths of shadowTex, every further level 2 x 2 texels of the
+// level below, which is the only level pyramidTex exposes meanwhile.
+// with skipEmpty, level 0 leaves out depths of 1 (nothing drawn), so
+// the range only spans geometry and is empty (min > max) without any.
+// with a sceneScale, level 0 reduces the texels of sceneDepthTex under
+// the pixel instead, sceneScale of them per pixel along each axis.
+
+uniform sampler2DArray shadowTex;
+uniform sampler2DArray pyramidTex;
+uniform sampler2D sceneDepthTex;
+uniform int layer;
+uniform int level;
+uniform bool skipEmpty;
+uniform vec2 sceneScale;
+
+layout(location=0) out vec2 out_Range;
+
+void main () {
+    if (level == 0 && sceneScale.x > 0.0) {
+        ivec2 size = textureSize(sceneDepthTex, 0);
+        ivec2 first = ivec2(floor((gl_FragCoord.xy - 0.5) * sceneScale));
+        ivec2 last = min(ivec2(ceil((gl_FragCoord.xy + 0.5) * sceneScale)), size) - 1;
+        vec2 range = vec2(1.0, 0.0);
+        for (int y = first.y; y <= last.y; ++y) {
+            for (int x = first.x; x <= last.x; ++x) {
+                float d = texelFetch(sceneDepthTex, ivec2(x, y), 0).r;
+                if (skipEmpty && d >= 1.0) {
+                    continue;
+                }
+                range = vec2(min(range.x, d), max(range.y, d));
+            }
+        }
+        out_Range = range;
+        return;
+    }
+    ivec2 texel = 2 * ivec2(gl_FragCoord.xy);
+    ivec2 size = level == 0 ? textureSize(shadowTex, 0).xy : textureSize(pyramidTex, 0).xy;
+    vec2 range = vec2(1.0, 0.0);
+    for (int i = 0; i < 4; ++i) {
+        ivec3 t = ivec3(min(texel + ivec2(i & 1, i >> 1), size - 1), layer);
+        vec2 r = level == 0 ? vec2(texelFetch(shadowTex, t, 0).r) : texelFetch(pyramidTex, t, 0).rg;
+        if (level == 0 && skipEmpty && r.x >= 1.0) {
+            continue;
+        }
+        range = vec2(min(range.x, r.x), max(range.y, r.y));
+    }
+    out_Range = range;
+}
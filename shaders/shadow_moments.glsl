@@ -0,0 +1,58 @@
+#version 330
+// fragment shader that turns one shadow map layer into blurred depth
+// moments, drawn on a full-screen quad in two passes of a separable
+// gaussian: pass 0 reads depths from shadowTex, converts them to
+// moments and blurs along x into a scratch texture; pass 1 blurs the
+// scratch texture along y into the moments layer.
+
+uniform sampler2DArray shadowTex;
+uniform sampler2D blurTex;
+uniform int layer;
+uniform int blurPass;
+uniform int blurRadius; // texels on each side
+
+// must match SHADOW_FILTER_* in shadowmap.h
+#define SHADOW_FILTER_EVSM 2
+uniform int shadowFilter;
+uniform float evsmExponent;
+
+layout(location=0) out vec4 out_Color;
+
+vec4 moments(float depth) {
+    if (shadowFilter == SHADOW_FILTER_EVSM) {
+        // warp depth exponentially, once positive and once negative,
+        // which shrinks light leaks where occluders overlap
+        float d = 2.0 * depth - 1.0;
+        float pos = exp(evsmExponent * d);
+        float neg = -exp(-evsmExponent * d);
+        return vec4(pos, pos * pos, neg, neg * neg);
+    }
+    return vec4(depth, depth * depth, 0, 0);
+}
+
+vec4 fetch(ivec2 texel) {
+    if (blurPass == 0) {
+        ivec2 size = textureSize(shadowTex, 0).xy;
+        texel = clamp(texel, ivec2(0), size - 1);
+        return moments(texelFetch(shadowTex, ivec3(texel, layer), 0).r);
+    }
+    ivec2 size = textureSize(blurTex, 0);
+    texel = clamp(texel, ivec2(0), size - 1);
+    return texelFetch(blurTex, texel, 0);
+}
+
+void main () {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    ivec2 dir = blurPass == 0 ? ivec2(1, 0) : ivec2(0, 1);
+
+    // the radius covers two standard deviations
+    float sigma = max(0.5 * float(blurRadius), 0.5);
+    vec4 sum = vec4(0);
+    float weights = 0;
+    for (int i = -blurRadius; i <= blurRadius; ++i) {
+        float w = exp(-float(i * i) / (2.0 * sigma * sigma));
+        sum += w * fetch(texel + i * dir);
+        weights += w;
+    }
+    out_Color = sum / weights;
+}
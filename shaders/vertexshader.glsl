@@ -8,11 +8,27 @@ layout(location=2) in vec3 Color;
 // we can use the same vertex shader for
 // shadow pass and light pass.
 
-uniform mat4 P;
-uniform mat4 V;
+// per-view constants, updated once per frame.
+// must match frameconstants in main.cpp
+#define MAX_CASCADES 4
+layout(std140) uniform FrameConstants {
+    mat4 V;
+    mat4 P;
+    mat4 light_VP[MAX_CASCADES]; // light view-projection per cascade
+    vec4 cascadeSplits; // far end of each cascade along the view axis
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightDiff;
+    int cascadeCount;
+};
+
 uniform mat4 M;
 uniform mat4 N;
 
+// the light pass tests against a depth prepass for equality, so both
+// have to compute exactly the same positions
+invariant gl_Position;
+
 // var_ (varying) variables are output in the vertex
 // shader and are interpolated by the GPU for each
 // pixel of the triangle.
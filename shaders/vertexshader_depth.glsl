@@ -0,0 +1,26 @@
+#version 330
+// minimal vertex shader for depth-only passes.
+// only positions are fetched, see StaticMesh::bindPositions().
+layout(location=0) in vec3 Position;
+
+// same block as in vertexshader.glsl
+#define MAX_CASCADES 4
+layout(std140) uniform FrameConstants {
+    mat4 V;
+    mat4 P;
+    mat4 light_VP[MAX_CASCADES]; // light view-projection per cascade
+    vec4 cascadeSplits; // far end of each cascade along the view axis
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightDiff;
+    int cascadeCount;
+};
+
+uniform mat4 M;
+
+// same as in vertexshader.glsl
+invariant gl_Position;
+
+void main () {
+    gl_Position = P * V * M * vec4(Position, 1);
+}
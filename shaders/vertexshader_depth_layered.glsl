@@ -0,0 +1,11 @@
+#version 330
+// vertex shader for the layered shadow pass. positions are only moved
+// to world space; geometryshader_depth_layered.glsl projects them
+// into every cascade.
+layout(location=0) in vec3 Position;
+
+uniform mat4 M;
+
+void main () {
+    gl_Position = M * vec4(Position, 1);
+}
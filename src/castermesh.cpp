@@ -0,0 +1,143 @@
+#include "castermesh.h"
+
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "objparser.h"
+
+// grid cell of a position, 21 bits per axis
+static uint64_t cellkey(const Vector3f& p, const Vector3f& origin, float cellsize)
+{
+    uint64_t key = 0;
+    for (int k = 0; k < 3; ++k) {
+        int64_t c = (int64_t)floorf((p[k] - origin[k]) / cellsize);
+        c = std::max((int64_t)0, std::min(c, (int64_t)(1 << 21) - 1));
+        key = (key << 21) | (uint64_t)c;
+    }
+    return key;
+}
+
+void simplifycasters(const objparser& scene, float cellsize, castergeometry* casters)
+{
+    casters->positions.clear();
+    casters->indices.clear();
+    if (scene.positions.empty()) {
+        return;
+    }
+    Vector3f origin = scene.positions[0];
+    for (const Vector3f& p : scene.positions) {
+        for (int k = 0; k < 3; ++k) {
+            origin[k] = std::min(origin[k], p[k]);
+        }
+    }
+
+    // one cluster per occupied cell, at the mean of its vertices
+    std::unordered_map<uint64_t, uint32_t> clusters;
+    std::vector<uint32_t> clusterof(scene.positions.size());
+    std::vector<int> counts;
+    for (size_t i = 0; i < scene.positions.size(); ++i) {
+        const Vector3f& p = scene.positions[i];
+        auto it = clusters.insert(std::make_pair(cellkey(p, origin, cellsize),
+            (uint32_t)casters->positions.size())).first;
+        if (it->second == casters->positions.size()) {
+            casters->positions.push_back(Vector3f(0, 0, 0));
+            counts.push_back(0);
+        }
+        clusterof[i] = it->second;
+        casters->positions[it->second] += p;
+        counts[it->second]++;
+    }
+    for (size_t i = 0; i < casters->positions.size(); ++i) {
+        casters->positions[i] = casters->positions[i] / (float)counts[i];
+    }
+
+    // triangles between three different clusters, each once. both
+    // windings are kept, depth passes draw without culling. the key
+    // packs the clusters exactly while their ids fit in 21 bits.
+    bool dedupe = casters->positions.size() <= ((size_t)1 << 21);
+    std::unordered_set<uint64_t> seen;
+    for (const draw_batch& batch : scene.batches) {
+        for (int i = batch.start_index; i + 2 < batch.start_index + batch.nindices; i += 3) {
+            uint32_t t[3];
+            for (int k = 0; k < 3; ++k) {
+                t[k] = clusterof[scene.indices[i + k]];
+            }
+            if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2]) {
+                continue;
+            }
+            // key of the triangle in canonical rotation
+            int first = t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2);
+            uint32_t a = t[first];
+            uint32_t b = t[(first + 1) % 3];
+            uint32_t c = t[(first + 2) % 3];
+            uint64_t key = ((uint64_t)a << 42) | ((uint64_t)b << 21) | c;
+            if (dedupe && !seen.insert(key).second) {
+                continue;
+            }
+            casters->indices.push_back(a);
+            casters->indices.push_back(b);
+            casters->indices.push_back(c);
+        }
+    }
+}
+
+CasterMesh::CasterMesh() :
+    m_vertexarray(0),
+    m_positionbuffer(0),
+    m_indexbuffer(0),
+    m_nindices(0)
+{
+}
+
+void CasterMesh::upload(const castergeometry& casters)
+{
+    free();
+    m_nindices = (int)casters.indices.size();
+
+    glGenBuffers(1, &m_positionbuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionbuffer);
+    glBufferData(GL_ARRAY_BUFFER, casters.positions.size() * sizeof(float) * 3,
+        casters.positions.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &m_indexbuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexbuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, casters.indices.size() * sizeof(uint32_t),
+        casters.indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    glGenVertexArrays(1, &m_vertexarray);
+    glBindVertexArray(m_vertexarray);
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionbuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexbuffer);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CasterMesh::free()
+{
+    glDeleteBuffers(1, &m_indexbuffer);
+    glDeleteBuffers(1, &m_positionbuffer);
+    glDeleteVertexArrays(1, &m_vertexarray);
+    m_indexbuffer = 0;
+    m_positionbuffer = 0;
+    m_vertexarray = 0;
+    m_nindices = 0;
+}
+
+void CasterMesh::bind() const
+{
+    glBindVertexArray(m_vertexarray);
+}
+
+void CasterMesh::draw(int start_index, int nindices) const
+{
+    if (nindices <= 0) {
+        return;
+    }
+    glDrawElements(GL_TRIANGLES, nindices, GL_UNSIGNED_INT,
+        (void*)(start_index * sizeof(uint32_t)));
+}
@@ -0,0 +1,50 @@
+#ifndef CASTERMESH_H
+#define CASTERMESH_H
+
+#include <cstdint>
+#include <vector>
+#include "gl.h"
+#include "vecmath.h"
+
+class objparser;
+
+// Simplified copy of the scene geometry for the depth passes of
+// lights. Shadows only need silhouettes, which survive far coarser
+// geometry than shading does. Positions only.
+struct castergeometry {
+    std::vector<Vector3f> positions;
+    std::vector<uint32_t> indices;
+};
+
+// simplifies the scene by vertex clustering: vertices are merged into
+// one per cell of a grid with cellsize spacing, at their mean position,
+// and triangles that collapse to a line or point are dropped, as are
+// duplicates. Surfaces move by up to a cell, so shadow views whose
+// texels are smaller than that should draw the full scene instead.
+void simplifycasters(const objparser& scene, float cellsize, castergeometry* casters);
+
+// Caster geometry on the GPU, for depth-only passes. Attribute 0 is
+// the position, like StaticMesh::bindPositions().
+class CasterMesh {
+public:
+    CasterMesh();
+
+    // replaces any previously uploaded geometry
+    void upload(const castergeometry& casters);
+    void free();
+    bool uploaded() const { return m_vertexarray != 0; }
+
+    // binds the vertex array. call once before a series of draw() calls.
+    void bind() const;
+    void draw(int start_index, int nindices) const;
+
+    int triangles() const { return m_nindices / 3; }
+
+private:
+    uint32_t m_vertexarray;
+    uint32_t m_positionbuffer;
+    uint32_t m_indexbuffer;
+    int m_nindices;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "locallights.h"
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// uniform float in [0, 1) from a 32 bit LCG
+static float nextrandom(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return (float)(*state >> 8) / (float)(1 << 24);
+}
+
+std::vector<locallight> makeLocalLights(const Vector3f& boxmin, const Vector3f& boxmax, int count)
+{
+    std::vector<locallight> lights;
+    uint32_t state = 12345;
+    Vector3f extent = boxmax - boxmin;
+    for (int i = 0; i < count; ++i) {
+        locallight light;
+        // inside the middle of the box, in its lower half
+        light.position = Vector3f(
+            boxmin.x() + extent.x() * (0.1f + 0.8f * nextrandom(&state)),
+            boxmin.y() + extent.y() * (0.15f + 0.35f * nextrandom(&state)),
+            boxmin.z() + extent.z() * (0.1f + 0.8f * nextrandom(&state)));
+        // spot lights point down and somewhat sideways
+        light.direction = Vector3f(nextrandom(&state) - 0.5f, -1.0f, nextrandom(&state) - 0.5f);
+        light.direction.normalize();
+        light.range = 0.25f * extent.abs();
+        light.cone = i % 2 == 0 ? 0.6f : 0.0f;
+        // warm and cold whites
+        float warmth = nextrandom(&state);
+        light.color = Vector3f(0.8f + 0.2f * warmth, 0.8f, 1.0f - 0.2f * warmth);
+        lights.push_back(light);
+    }
+    return lights;
+}
+
+int shadowViewCount(const locallight& light)
+{
+    return light.cone > 0 ? 1 : 6;
+}
+
+Matrix4f localLightView(const locallight& light, int face)
+{
+    if (light.cone > 0) {
+        // any up vector that is not parallel to the direction
+        Vector3f side = fabsf(light.direction.y()) < 0.9f ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0);
+        Vector3f up = Vector3f::cross(Vector3f::cross(light.direction, side), light.direction);
+        return Matrix4f::lookAt(light.position, light.position + light.direction, up.normalized());
+    }
+    static const Vector3f FORWARD[6] = {
+        Vector3f(1, 0, 0), Vector3f(-1, 0, 0), Vector3f(0, 1, 0),
+        Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1)
+    };
+    static const Vector3f UP[6] = {
+        Vector3f(0, 1, 0), Vector3f(0, 1, 0), Vector3f(0, 0, 1),
+        Vector3f(0, 0, 1), Vector3f(0, 1, 0), Vector3f(0, 1, 0)
+    };
+    return Matrix4f::lookAt(light.position, light.position + FORWARD[face], UP[face]);
+}
+
+Matrix4f localLightProjection(const locallight& light)
+{
+    // cube faces span 90 degrees each
+    float fov = light.cone > 0 ? 2.0f * light.cone : 0.5f * 3.141592f;
+    return Matrix4f::perspectiveProjection(fov, 1.0f, 0.02f * light.range, light.range);
+}
+
+float screenCoverage(const locallight& light, const Matrix4f& V, const Matrix4f& P)
+{
+    Vector3f center = (V * Vector4f(light.position, 1)).xyz();
+    float depth = -center.z();
+    float radius = light.range;
+    if (depth < -radius) {
+        return 0.0f;
+    }
+    // side planes of the frustum, pushed out by the radius
+    float tanx = 1.0f / P(0, 0);
+    float tany = 1.0f / P(1, 1);
+    if (fabsf(center.x()) - radius * sqrtf(1 + tanx * tanx) > depth * tanx ||
+        fabsf(center.y()) - radius * sqrtf(1 + tany * tany) > depth * tany) {
+        return 0.0f;
+    }
+    if (depth <= radius) {
+        // the camera is inside of the sphere
+        return 1.0f;
+    }
+    return std::min(1.0f, radius / (depth * tany));
+}
@@ -0,0 +1,42 @@
+#ifndef LOCALLIGHTS_H
+#define LOCALLIGHTS_H
+
+#include <vector>
+#include "vecmath.h"
+
+// lights and shadow views the shaders have room for;
+// must match fragmentshader_dirlight.glsl
+const int MAX_LOCAL_LIGHTS = 32;
+const int MAX_LOCAL_VIEWS = 128;
+
+// Spot and point lights of limited range. Each one casts shadows
+// through views in the shadow atlas: a spot light through one
+// perspective view of its cone, a point light through the six faces
+// of a cube around it.
+struct locallight {
+    Vector3f position;
+    Vector3f direction; // spot lights only
+    float range;        // no light reaches further
+    float cone;         // half angle of a spot light in radians, 0 for point lights
+    Vector3f color;
+};
+
+// count lights spread over a box, alternately spot and point lights.
+// they come from a fixed seed, so every run gets the same ones.
+std::vector<locallight> makeLocalLights(const Vector3f& boxmin, const Vector3f& boxmax, int count);
+
+// 1 for spot lights, 6 for point lights
+int shadowViewCount(const locallight& light);
+
+// view and projection of one shadow view. the faces of a point light
+// look along +x, -x, +y, -y, +z and -z, in this order; the lighting
+// shader picks them the same way.
+Matrix4f localLightView(const locallight& light, int face);
+Matrix4f localLightProjection(const locallight& light);
+
+// share of the screen height covered by the sphere the light reaches,
+// for a camera with view V and perspective projection P. 0 if the
+// sphere lies outside of the view frustum.
+float screenCoverage(const locallight& light, const Matrix4f& V, const Matrix4f& P);
+
+#endif
@@ -9,8 +9,13 @@
 #include <lodepng.h>
 #include <map>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
 
 #include "objparser.h"
+#include "staticmesh.h"
+#include "castermesh.h"
+#include "shadowmap.h"
 
 // some utility code is tucked away in main.h
 // for example, drawing the coordinate axes
@@ -20,10 +25,107 @@
 #include "iostream"
 
 using namespace std;
-// 4096x4096 is a pretty large texture. Extensions to shadow algorithm
-// (extra credit) help lowering this memory footprint.
-const int SHADOW_WIDTH = 4096;
-const int SHADOW_HEIGHT = 4096;
+// The camera frustum is split into cascades, each with its own
+// shadowSize x shadowSize layer. Four 1024x1024 cascades give sharper
+// shadows near the camera than a single 4096x4096 map at a quarter of
+// the memory. size, depth format and number of cascades can be changed
+// at runtime, see setShadowMapSize(), setShadowMapFormat() and
+// setShadowCascades().
+const int SHADOW_MIN_SIZE = 256;
+int shadowSize = 1024;
+int shadowFormat = SHADOW_DEPTH24;
+int shadowCascades = MAX_CASCADES;
+// a single map with a light space perspective warp (LiSPSM) instead of
+// cascades, for a quarter of their memory and depth pass draws. 'W'
+// toggles it, 'E'/'R' weaken and strengthen the warp.
+bool shadowWarp = false;
+float shadowWarpStrength = 1.0f;
+// render all cascades in one layered pass instead of one pass each.
+// toggled with 'L' for comparison.
+bool shadowLayered = true;
+// skips the depth pass while the cached shadow map is still valid
+// and spreads refreshes of stale cascades over several frames
+ShadowCache shadowCache;
+bool shadowAmortize = true;
+// triangles the depth pass may draw per frame when amortizing;
+// each refreshed cascade costs one pass over the scene
+int shadowTriangleBudget = 500000;
+int shadowUpdateMask; // cascades to render this frame
+// shadow maps of earlier light directions, reused when the light
+// returns to one of them. 0 disables the pool.
+ShadowMapPool shadowPool;
+size_t shadowPoolBudget = 64 * 1024 * 1024;
+uint64_t shadowMapKey; // light direction the current shadow map is for
+bool shadowMapKeyValid = false;
+// soft shadows: the filterable modes resolve the depth map into blurred
+// and mipmapped moments after every depth pass, so shading costs one
+// lookup for any blur radius. the moments are only allocated while a
+// filterable mode is on. light bleed reduction and the EVSM exponent
+// trade light leaks against overly dark penumbrae.
+int shadowFilter = SHADOW_FILTER_HARD;
+int shadowMomentFormat = SHADOW_MOMENTS32F;
+int shadowBlurRadius = 2;
+float shadowLightBleed = 0.2f;
+float shadowEvsmExponent = 40.0f;
+int shadowMomentsStale; // layers whose moments do not match the depth map
+// PCF kernel of the depth compare, see PCF_* in main.h. 'T' prints
+// the cost and quality of every kernel.
+int shadowKernel = PCF_GRID_9;
+// PCSS: penumbrae widen away from their blockers as under a light of
+// this angular radius. the blocker search reads a min/max pyramid of
+// the shadow map, only allocated and built while PCSS is in use.
+float shadowLightAngle = 1.0f; // degrees
+int shadowPyramidStale; // layers whose pyramid does not match the depth map
+// spot and point lights with shadow views in one atlas. every frame
+// each visible light asks for tiles by its screen coverage and
+// brightness. the atlas has a fixed size, so tiles shrink when many
+// lights are in view, and views are only rendered when their tile
+// changed. 'G' changes the number of lights, none at first; the atlas
+// is only allocated while there are some.
+const int SHADOW_ATLAS_SIZE = 4096;
+ShadowAtlas shadowAtlas;
+std::vector<locallight> localLights;
+int localLightCount = 0;
+// sample distribution shadow maps: cascades fitted to what the camera
+// sees. the depth prepass of the camera, or a small depth pass of its
+// own without one, is reduced on the GPU to the depth range of each of
+// a grid of tiles. the tiles are copied into
+// one of a ring of pixel buffers, and only fetched once a fence says
+// the copy is done, so the readback never waits for the GPU. the
+// targets are only allocated while this is on; 'D' toggles it.
+const int DEPTH_SAMPLE_SIZE = 256;
+const int DEPTH_TILE_LEVEL = 3; // pyramid level that holds the tiles, 16 x 16
+const int DEPTH_TILE_READBACKS = 3;
+struct depthtilereadback {
+    GLuint pbo;
+    GLsync fence; // set while the copy into pbo is in flight
+    Matrix4f view; // camera of the samples
+    Matrix4f projection;
+};
+bool shadowSampleDistribution = false;
+ShadowMap depthSamples; // camera depth, a single layer
+ShadowPyramid depthSampleRanges;
+depthtilereadback depthTileReadbacks[DEPTH_TILE_READBACKS];
+int depthTileNext; // readback slot of the next depth pass
+depthtiles depthTiles; // read back last
+// screen-space contact shadows: the light pass marches short rays
+// towards the light over a depth prepass of the camera, which restores
+// contacts that are finer than the shadow map. the prepass also spares
+// the light pass shading hidden surfaces. 'H' toggles them, '9'/'0'
+// change the ray length.
+bool contactShadows = true;
+float contactShadowLength = 0.5f;
+DepthBuffer sceneDepth; // only allocated while contact shadows are on
+// depth passes of lights draw a simplified copy of the scene, clustered
+// on a grid of the scene size / shadowCasterCells; shading and depth
+// passes of the camera keep the full scene. the cells have nothing to
+// do with shadow map texels, and clustering moves surfaces by up to a
+// cell, more than the normal offset of the nearest cascade covers. so
+// the first cascade, which has the finest texels, draws the full scene
+// too; coarser cascades and local lights draw the simplified copy.
+// 0 draws the full scene for all of them. 'X' cycles the detail.
+int shadowCasterCells = 512;
+CasterMesh casterMesh;
 
 // FUNCTION DECLARATIONS - you will implement these
 void loadTextures();
@@ -31,22 +133,97 @@ void freeTextures();
 
 void loadFramebuffer();
 void freeFramebuffer();
+void loadShadowMoments();
+void loadShadowPyramid();
+void loadShadowAtlas();
+void loadDepthSamples();
+void freeDepthSamples();
+
+void loadUniformBuffers();
+void freeUniformBuffers();
+void updateFrameConstants();
 
 void draw();
 
-Matrix4f getLightView();
-Matrix4f getLightProjection();
+Matrix4f getLightView(const Vector3f& dir);
 
 // Globals here.
 objparser scene;
 Vector3f  light_dir;
 glfwtimer timer;
-VertexRecorder rec;
+StaticMesh sceneMesh; // scene geometry, uploaded once after parsing
 std::map<std::string, GLuint> glTextures;
+std::vector<GLuint> materialTextures; // diffuse texture per material id, 0 if none
+
+ShadowMap shadowMap; // one layer per cascade
+ShadowMoments shadowMoments; // filterable copy of shadowMap
+ShadowPyramid shadowPyramid; // min/max depths of shadowMap
+shadowcascades cascades; // light projections the shadow map layers hold
+Vector3f sceneMin; // bounds of the scene geometry
+Vector3f sceneMax;
+
+size_t frame_streamed_bytes; // VertexRecorder bytes streamed last frame
+
+// std140 layout of the FrameConstants block in the shaders
+struct frameconstants {
+    float V[16];
+    float P[16];
+    float light_VP[MAX_CASCADES][16];
+    float cascadeSplits[MAX_CASCADES];
+    float camPos[4];
+    float lightPos[4];
+    float lightDiff[3];
+    int cascadeCount; // packed into the last vec3
+};
+
+static_assert(MAX_CASCADES == 4, "cascadeSplits is a vec4 in the shaders");
+
+// std140 layout of one entry of the Materials block
+struct materialconstants {
+    float diffuse[4];  // rgb, alpha
+    float ambient[4];  // rgb
+    float specular[4]; // rgb, shininess
+};
+// entries of the Materials block; must match fragmentshader_dirlight.glsl.
+// scenes with more materials get several pages of this many, and each
+// batch binds the page its material is on.
+const int MAX_MATERIALS = 256;
+
+// std140 layout of one entry of the LocalLights block
+struct locallightconstants {
+    float position[4];  // xyz, range
+    float direction[4]; // xyz, cosine of the spot cone; -1 for point lights
+    float color[4];     // rgb, tangent of half the field of view of its views
+    int shadow[4];      // first view, number of views
+};
+// std140 layout of the LocalLights block in fragmentshader_dirlight.glsl
+struct locallightsblock {
+    locallightconstants lights[MAX_LOCAL_LIGHTS];
+    float VP[MAX_LOCAL_VIEWS][16];
+    float tiles[MAX_LOCAL_VIEWS][4]; // atlas offset, scale
+    int count;
+};
+
+// shadow view of a local light, see updateLocalLights()
+struct localview {
+    int light; // index into localLights
+    int face;
+    Matrix4f view;
+    Matrix4f projection;
+    shadowtile tile;
+    bool render; // the tile does not hold this view yet
+};
+std::vector<localview> localViews; // views of this frame, VIEW_LOCAL0 onwards
+// what the atlas holds, per light and face (light * 6 + face)
+std::vector<shadowtile> localTilesHeld;
+int localLightsVisible;
+int localViewsRendered; // last frame
 
-GLuint fb; // framebuffer handle
-GLuint fb_depthtex; // framebuffer depth texture handle
-GLuint fb_colortex; // framebuffer color texture handle
+GLuint frameUBO; // NUM_VIEWS frameconstants, rewritten once per frame
+GLuint materialUBO; // materialconstants of all scene materials
+GLuint localLightUBO; // locallightsblock, rewritten once per frame
+GLint frameStride; // offset between views in frameUBO
+GLint materialPageStride; // offset between pages of MAX_MATERIALS in materialUBO
 
 // animate light source direction
 void updateLightDirection() {
@@ -59,80 +236,382 @@ void updateLightDirection() {
 }
 
 
-void drawScene(GLint program, Matrix4f V, Matrix4f P) {
+static float evsmExponent() {
+    return std::min(shadowEvsmExponent, ShadowMoments::maxExponent(shadowMomentFormat));
+}
+
+void drawScene(const programuniforms& uniforms, int view) {
     
-    Matrix4f M = Matrix4f::identity();
-    updateTransformUniforms( program, M, V, P);
+    bindFrameConstants(view);
+    updateModelUniforms(uniforms, Matrix4f::identity());
     
-    int i = 0;
-    for(draw_batch batch : scene.batches) {
-        int ii = 0;
-        for (int ii = batch.start_index; ii < batch.start_index + batch.nindices; ii++) {
-	  int currentBatchIndex = scene.indices[ii];
-	  rec.record(
-		     scene.positions[currentBatchIndex],
-                       scene.normals[currentBatchIndex],
-		     Vector3f(scene.texcoords[currentBatchIndex][0], scene.texcoords[currentBatchIndex][1], 0));
-	  
+    // bind the shadow map to texture1 and its moments to texture2; switch back.
+    // lookups of the shadow map compare depths in the sampler
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowMap.texture());
+    glBindSampler(1, shadowMap.compareSampler());
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowMoments.texture());
+    // for PCSS: depth pyramid to texture3, plain depths to texture4
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowPyramid.texture());
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowMap.texture());
+    // shadow views of local lights to texture5
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowAtlas.texture());
+    glBindSampler(5, shadowAtlas.compareSampler());
+    // depth of the camera for contact shadows to texture6
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, sceneDepth.texture());
+    glActiveTexture(GL_TEXTURE0);
+
+    sceneMesh.bind();
+    GLuint boundTexture = 0;
+    int boundPage = -1;
+    glBindTexture(GL_TEXTURE_2D, 0);
+    for(const draw_batch& batch : scene.batches) {
+        // material constants live in materialUBO, only the index changes,
+        // and the page when the material is on another one
+        int page = batch.material_id / MAX_MATERIALS;
+        if (page != boundPage) {
+            glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK, materialUBO,
+                page * materialPageStride, MAX_MATERIALS * sizeof(materialconstants));
+            boundPage = page;
         }
-        
-        updateMaterialUniforms( program, batch.mat.diffuse, batch.mat.ambient, batch.mat.specular, batch.mat.shininess);
+        glUniform1i(uniforms.materialIndex, batch.material_id % MAX_MATERIALS);
         
         // Diffuse Texture handling:
-        GLuint texture = glTextures[batch.mat.diffuse_texture];
-        glBindTexture(GL_TEXTURE_2D, texture);
-        
-	// bind the depth texture to texture1; switch back
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, fb_depthtex);
-	glActiveTexture(GL_TEXTURE0);
-	
-	// Shadow mapping:
-	int loc = glGetUniformLocation(program, "shadowTex");
-	glUniform1i(loc, 1) ; // bind sample to texture unit 
-	
-	Matrix4f vp =  getLightProjection() * getLightView();
-        int matrixloc = glGetUniformLocation(program, "light_VP");
-        glUniformMatrix4fv(matrixloc, 1, false, vp);
+        // batches are sorted by texture, so consecutive batches often share one
+        GLuint texture = materialTextures[batch.material_id];
+        if (texture != boundTexture) {
+            glBindTexture(GL_TEXTURE_2D, texture);
+            boundTexture = texture;
+        }
 
-	rec.draw();
-        i++;
-        rec.clear();
+	sceneMesh.draw(batch.start_index, batch.nindices);
     }
+    glBindVertexArray(0);
+    glBindSampler(1, 0);
+    glBindSampler(5, 0);
 }
 
-void draw() {
-    
-    // 1. LIGHT PASS
+// shades the scene into the window with one of the PCF kernels
+void drawLightPass(int kernel) {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     int winw, winh;
     glfwGetFramebufferSize(window, &winw, &winh);
     glViewport(0, 0, winw, winh);
-    glUseProgram(program_light);
-    updateLightUniforms(program_light, light_dir, Vector3f(1.2f, 1.2f, 1.2f));
+    const programuniforms& uniforms = uniforms_light[kernel];
+    glUseProgram(program_light[kernel]);
+    glUniform1i(uniforms.shadowFilter,
+        shadowMoments.allocated() ? shadowFilter : SHADOW_FILTER_HARD);
+    glUniform1f(uniforms.lightBleed, shadowLightBleed);
+    glUniform1f(uniforms.evsmExponent, evsmExponent());
+    glUniform1f(uniforms.lightTanAngle, tanf(deg2rad(shadowLightAngle)));
+    glUniform1f(uniforms.contactLength, sceneDepth.allocated() ? contactShadowLength : 0.0f);
 
-    drawScene(program_light, camera.GetViewMatrix(), camera.GetPerspective());
+    drawScene(uniforms, VIEW_CAMERA);
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
-    // 2. DEPTH PASS
-    glBindFramebuffer(GL_FRAMEBUFFER, fb);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-    glUseProgram(program_color);
+// depth-only pass: positions only, no materials or textures,
+// so the whole scene is a single draw call
+void drawSceneDepth(const programuniforms& uniforms, int view) {
+    bindFrameConstants(view);
+    updateModelUniforms(uniforms, Matrix4f::identity());
+
+    sceneMesh.bindPositions();
+    sceneMesh.draw(0, (int)scene.indices.size());
+    glBindVertexArray(0);
+}
+
+// depth-only pass of a light, with the simplified casters if there are
+void drawShadowCasters(const programuniforms& uniforms, int view) {
+    if (!casterMesh.uploaded()) {
+        drawSceneDepth(uniforms, view);
+        return;
+    }
+    bindFrameConstants(view);
+    updateModelUniforms(uniforms, Matrix4f::identity());
+
+    casterMesh.bind();
+    casterMesh.draw(0, casterMesh.triangles() * 3);
+    glBindVertexArray(0);
+}
+
+// converts the depth of the layers in mask into moments, blurs them
+// in two separable passes and updates the mipmaps
+void resolveShadowMoments(int mask) {
+    mask &= (1 << cascades.count) - 1;
+    if (!mask) {
+        return;
+    }
+    glUseProgram(program_moments);
+    bindFrameConstants(VIEW_SCREEN);
+    updateModelUniforms(uniforms_moments, Matrix4f::identity());
+    glUniform1i(uniforms_moments.shadowFilter, shadowFilter);
+    glUniform1f(uniforms_moments.evsmExponent, evsmExponent());
+    glUniform1i(uniforms_moments.blurRadius, shadowBlurRadius);
 
-    drawScene(program_color, getLightView(), getLightProjection());
+    glDisable(GL_DEPTH_TEST);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowMap.texture());
+    glActiveTexture(GL_TEXTURE0);
+    for (int i = 0; i < cascades.count; ++i) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        glUniform1i(uniforms_moments.layer, i);
+        // depth to moments, blurred along x
+        shadowMoments.bindScratch();
+        glUniform1i(uniforms_moments.blurPass, 0);
+        drawUnitQuad();
+        // blurred along y into the layer
+        shadowMoments.bindLayer(i);
+        glUniform1i(uniforms_moments.blurPass, 1);
+        glBindTexture(GL_TEXTURE_2D, shadowMoments.scratch());
+        drawUnitQuad();
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glEnable(GL_DEPTH_TEST);
+    shadowMoments.generateMipmaps();
+}
 
+// reduces the depths of the layers of map in mask into the first
+// levels of pyramid, one level after the other. skipempty leaves
+// out depths of 1, where nothing was drawn. with a scene depth,
+// level 0 reduces the part of it under each texel instead of map,
+// which must then have a single layer.
+static void buildMinMaxPyramid(const ShadowMap& map, const ShadowPyramid& pyramid,
+    int mask, int levels, bool skipempty, const DepthBuffer* scenedepth = nullptr) {
+    glUseProgram(program_minmax);
+    bindFrameConstants(VIEW_SCREEN);
+    updateModelUniforms(uniforms_minmax, Matrix4f::identity());
+    glUniform1i(uniforms_minmax.skipEmpty, skipempty);
+    if (scenedepth) {
+        glUniform2f(uniforms_minmax.sceneScale, (float)scenedepth->width() / pyramid.size(),
+            (float)scenedepth->height() / pyramid.size());
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_2D, scenedepth->texture());
+    }
+    else {
+        glUniform2f(uniforms_minmax.sceneScale, 0.0f, 0.0f);
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, map.texture());
+    // unbound while level 0 is written
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    for (int level = 0; level < levels; ++level) {
+        glUniform1i(uniforms_minmax.level, level);
+        // level 0 reads the shadow map, the others the level below
+        if (level > 0) {
+            pyramid.readLevel(level - 1);
+        }
+        for (int i = 0; i < map.layers(); ++i) {
+            if (mask & (1 << i)) {
+                glUniform1i(uniforms_minmax.layer, i);
+                pyramid.bindLevel(i, level);
+                drawUnitQuad();
+            }
+        }
+    }
+    pyramid.readLevel(-1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// reduces the depths of the layers in mask into the min/max pyramid
+void buildShadowPyramid(int mask) {
+    mask &= (1 << cascades.count) - 1;
+    if (!mask) {
+        return;
+    }
+    buildMinMaxPyramid(shadowMap, shadowPyramid, mask, shadowPyramid.levels(), false);
+}
+
+// reduces the depth of the camera view to the depth range per tile
+// and starts reading the tiles back, see readDepthTiles(). reuses the
+// depth prepass of the contact shadows when there is one, otherwise
+// renders a small depth pass of its own.
+void sampleDepthDistribution() {
+    if (sceneDepth.allocated()) {
+        buildMinMaxPyramid(depthSamples, depthSampleRanges, 1, DEPTH_TILE_LEVEL + 1, true,
+            &sceneDepth);
+    }
+    else {
+        depthSamples.bindLayer(0);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUseProgram(program_depth);
+        drawSceneDepth(uniforms_depth, VIEW_CAMERA);
+        buildMinMaxPyramid(depthSamples, depthSampleRanges, 1, DEPTH_TILE_LEVEL + 1, true);
+    }
+
+    // into the next pixel buffer of the ring; the copy completes while
+    // the GPU works on the rest of the frame. a slot that was never
+    // fetched is simply overwritten.
+    depthtilereadback& r = depthTileReadbacks[depthTileNext];
+    depthTileNext = (depthTileNext + 1) % DEPTH_TILE_READBACKS;
+    int tiles = depthSampleRanges.size() >> DEPTH_TILE_LEVEL;
+    depthSampleRanges.bindLevel(0, DEPTH_TILE_LEVEL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+    glReadPixels(0, 0, tiles, tiles, GL_RG, GL_FLOAT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (r.fence) {
+        glDeleteSync(r.fence);
+    }
+    r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // the same camera updateFrameConstants() set up VIEW_CAMERA with
+    r.view = camera.GetViewMatrix();
+    r.projection = camera.GetPerspective();
+}
+
+// fetches the newest tiles sampleDepthDistribution() has finished
+// reading back, if any. older readbacks still in the ring are dropped.
+void readDepthTiles() {
+    for (int k = 1; k <= DEPTH_TILE_READBACKS; ++k) {
+        int slot = (depthTileNext + DEPTH_TILE_READBACKS - k) % DEPTH_TILE_READBACKS;
+        depthtilereadback& r = depthTileReadbacks[slot];
+        if (!r.fence || glClientWaitSync(r.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            continue;
+        }
+        int tiles = depthSampleRanges.size() >> DEPTH_TILE_LEVEL;
+        depthTiles.size = tiles;
+        depthTiles.ranges.resize(tiles * tiles * 2);
+        depthTiles.view = r.view;
+        depthTiles.projection = r.projection;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, depthTiles.ranges.size() * sizeof(float),
+            depthTiles.ranges.data());
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        for (; k <= DEPTH_TILE_READBACKS; ++k) {
+            depthtilereadback& older =
+                depthTileReadbacks[(depthTileNext + DEPTH_TILE_READBACKS - k) % DEPTH_TILE_READBACKS];
+            if (older.fence) {
+                glDeleteSync(older.fence);
+                older.fence = 0;
+            }
+        }
+        return;
+    }
+}
+
+void draw() {
     
-    // 3. DRAW DEPTH TEXTURE AS QUAD
-    glViewport(0, 0, 256, 256);
-    drawTexturedQuad(fb_depthtex);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // 1. DEPTH PASS
+    // only the cascades scheduled by the shadow cache are rendered,
+    // see updateFrameConstants()
+    for (int i = 0; i < cascades.count; ++i) {
+        if (shadowUpdateMask & (1 << i)) {
+            shadowMap.bindLayer(i);
+            glClear(GL_DEPTH_BUFFER_BIT);
+        }
+    }
+    if (shadowUpdateMask && shadowLayered) {
+        // a geometry shader fans every triangle out to the scheduled
+        // cascades, so the pass costs the same draw calls for any
+        // cascade count. every view carries the matrices of all cascades.
+        // the first cascade takes the full scene, the others the casters
+        glUseProgram(program_depth_layered);
+        shadowMap.bindLayers();
+        if (shadowUpdateMask & 1) {
+            glUniform1i(uniforms_depth_layered.layerMask, 1);
+            drawSceneDepth(uniforms_depth_layered, VIEW_CASCADE0);
+        }
+        if (shadowUpdateMask & ~1) {
+            glUniform1i(uniforms_depth_layered.layerMask, shadowUpdateMask & ~1);
+            drawShadowCasters(uniforms_depth_layered, VIEW_CASCADE0);
+        }
+    }
+    else if (shadowUpdateMask) {
+        // one depth-only pass per cascade
+        glUseProgram(program_depth);
+        for (int i = 0; i < cascades.count; ++i) {
+            if (shadowUpdateMask & (1 << i)) {
+                shadowMap.bindLayer(i);
+                if (i == 0) {
+                    drawSceneDepth(uniforms_depth, VIEW_CASCADE0);
+                }
+                else {
+                    drawShadowCasters(uniforms_depth, VIEW_CASCADE0 + i);
+                }
+            }
+        }
+    }
 
-    glViewport(256, 0, 256, 256);
-    drawTexturedQuad(fb_colortex);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // shadow views of local lights whose tile changed
+    localViewsRendered = 0;
+    glUseProgram(program_depth);
+    for (size_t i = 0; i < localViews.size(); ++i) {
+        if (localViews[i].render) {
+            shadowAtlas.bindTile(localViews[i].tile);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            drawShadowCasters(uniforms_depth, VIEW_LOCAL0 + (int)i);
+            localViewsRendered++;
+        }
+    }
+    shadowAtlas.unbindTile();
+
+    // moments of the layers that changed, for filtered lookups
+    if (shadowMoments.allocated()) {
+        resolveShadowMoments(shadowUpdateMask | shadowMomentsStale);
+        shadowMomentsStale = 0;
+    }
+
+    // depth pyramid of the layers that changed, for the PCSS blocker
+    // search. without PCSS they are only marked stale
+    shadowPyramidStale |= shadowUpdateMask;
+    if (shadowKernel == PCF_PCSS) {
+        buildShadowPyramid(shadowPyramidStale);
+        shadowPyramidStale = 0;
+    }
+
+    // depth prepass of the camera into the window, which was cleared
+    // before draw(). the contact shadows march over a copy of it, and
+    // the light pass only shades the visible surfaces.
+    if (contactShadows) {
+        int winw, winh;
+        glfwGetFramebufferSize(window, &winw, &winh);
+        sceneDepth.allocate(winw, winh);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, winw, winh);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glUseProgram(program_depth);
+        drawSceneDepth(uniforms_depth, VIEW_CAMERA);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        sceneDepth.copyFromWindow();
+    }
+
+    // camera depth ranges, for fitting the cascades of the next frame
+    if (shadowSampleDistribution) {
+        sampleDepthDistribution();
+    }
+
+    // 2. LIGHT PASS
+    // after the prepass, depths are tested for equality and not written
+    if (contactShadows) {
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+    }
+    drawLightPass(shadowKernel);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+
+    // 3. DRAW CASCADES AS QUADS, THE ATLAS TOP RIGHT
+    for (int i = 0; i < cascades.count; ++i) {
+        glViewport(i * 128, 0, 128, 128);
+        drawShadowMapLayer(shadowMap.texture(), i);
+    }
+    if (!localViews.empty()) {
+        int winw, winh;
+        glfwGetFramebufferSize(window, &winw, &winh);
+        glViewport(winw - 128, winh - 128, 128, 128);
+        drawShadowMapLayer(shadowAtlas.texture(), 0);
+    }
 }
 
 void loadTextures() {
@@ -146,7 +625,7 @@ void loadTextures() {
         glBindTexture(GL_TEXTURE_2D, glTexture);
 
         // Allocate storage for texture; upload pixel data
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, im.w, im.h, 0, GL_RGB, GL_UNSIGNED_BYTE, im.data.data());
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, im.w, im.h, 0, GL_RGB, GL_UNSIGNED_BYTE, im.pixels.get());
 
         // Enable BiLinear Filtering
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -154,6 +633,13 @@ void loadTextures() {
         // Store texture
         glTextures.insert(std::make_pair(name, glTexture));
     }
+
+    // resolve textures per material once, so drawing does no lookups
+    materialTextures.clear();
+    for (const material& mat : scene.materials) {
+        auto it = glTextures.find(mat.diffuse_texture);
+        materialTextures.push_back(it != glTextures.end() ? it->second : 0);
+    }
 }
 
 void freeTextures() {
@@ -164,62 +650,629 @@ void freeTextures() {
         glDeleteTextures(1, &glTexture);
     }
     glTextures.clear();
+    materialTextures.clear();
 }
 
 void loadFramebuffer() {
-  glGenTextures(1, &fb_depthtex);
-  glGenTextures(1, &fb_colortex);
-    
-  // Handle color texture:
-  glBindTexture(GL_TEXTURE_2D, fb_colortex);
-  
-  // Allocate storage for color texture; will be filled by rendering into the texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4096, 4096, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
-  
-  // configure texture interpolation settings
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  
-  // Handle depth texture:
-  glBindTexture(GL_TEXTURE_2D, fb_depthtex);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 4096, 4096, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  
-  // Request handle for framebuffer
-  glGenFramebuffers(1, &fb);
-
-  // bind current framebuffer object
-  glBindFramebuffer(GL_FRAMEBUFFER, fb);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fb_colortex, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, fb_depthtex, 0);
-  
-  // check configuration:
-  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-  if( status != GL_FRAMEBUFFER_COMPLETE) {
+  GLint maxsize;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+  if (shadowSize > maxsize) {
+    shadowSize = maxsize;
+  }
+
+  // depth-only framebuffer with one texture layer per cascade
+  int layers = shadowWarp ? 1 : shadowCascades;
+  if (!shadowMap.allocate(shadowSize, layers, shadowFormat)) {
     printf("Error, incomplete framebuffer\n");
     exit(-1);
   }
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  loadShadowPyramid();
+  loadShadowMoments();
+}
+
+// (re)allocates the moments to match the shadow map,
+// or frees them if the filter does not need any
+void loadShadowMoments() {
+  shadowMoments.free();
+  if (shadowFilter == SHADOW_FILTER_HARD) {
+    return;
+  }
+  if (!shadowMoments.allocate(shadowMap.size(), shadowMap.layers(), shadowMomentFormat)) {
+    printf("Error, incomplete moments framebuffer\n");
+    exit(-1);
+  }
+  invalidateShadowMoments();
+}
+
+// (re)allocates the depth pyramid to match the shadow map,
+// or frees it if the kernel does not need one
+void loadShadowPyramid() {
+  shadowPyramid.free();
+  if (shadowKernel != PCF_PCSS) {
+    return;
+  }
+  if (!shadowPyramid.allocate(shadowMap.size(), shadowMap.layers())) {
+    printf("Error, incomplete depth pyramid framebuffer\n");
+    exit(-1);
+  }
+  invalidateShadowPyramid();
+}
+
+void loadDepthSamples() {
+    if (!depthSamples.allocate(DEPTH_SAMPLE_SIZE, 1, SHADOW_DEPTH32F) ||
+        !depthSampleRanges.allocate(DEPTH_SAMPLE_SIZE, 1)) {
+        printf("Error, incomplete depth sample framebuffer\n");
+        exit(-1);
+    }
+    int tiles = depthSampleRanges.size() >> DEPTH_TILE_LEVEL;
+    for (depthtilereadback& r : depthTileReadbacks) {
+        glGenBuffers(1, &r.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, tiles * tiles * 2 * sizeof(float), nullptr, GL_STREAM_READ);
+        r.fence = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    depthTileNext = 0;
+    depthTiles.ranges.clear();
+}
+
+void freeDepthSamples() {
+    depthSamples.free();
+    depthSampleRanges.free();
+    for (depthtilereadback& r : depthTileReadbacks) {
+        glDeleteBuffers(1, &r.pbo);
+        r.pbo = 0;
+        if (r.fence) {
+            glDeleteSync(r.fence);
+            r.fence = 0;
+        }
+    }
+    depthTiles.ranges.clear();
 }
 
 void freeFramebuffer() {
-   glDeleteTextures(1, &fb_depthtex);
-   glDeleteTextures(1, &fb_colortex);
-   glDeleteFramebuffers(1, &fb);
+   shadowMap.free();
+   shadowMoments.free();
+   shadowPyramid.free();
+   shadowCache.invalidate();
+   // parked maps no longer match the settings
+   shadowPool.clear();
+}
+
+void printShadowMapInfo() {
+    double mb = (double)shadowMap.bytes() / (1024 * 1024);
+    printf("Shadow map %d x %dx%d, %s depth, %.1f MB, %s\n", shadowMap.layers(),
+        shadowMap.size(), shadowMap.size(), ShadowMap::formatName(shadowMap.format()), mb,
+        shadowWarp ? "LiSPSM warped" : "cascades");
+    if (shadowPyramid.allocated()) {
+        printf("Shadow depth pyramid %d levels, %.1f MB\n", shadowPyramid.levels(),
+            (double)shadowPyramid.bytes() / (1024 * 1024));
+    }
+    if (shadowMoments.allocated()) {
+        static const char* FILTER_NAMES[NUM_SHADOW_FILTERS] = { "hard", "VSM", "EVSM" };
+        printf("Shadow moments for %s, %s, blur radius %d, %.1f MB\n",
+            FILTER_NAMES[shadowFilter], ShadowMoments::formatName(shadowMoments.format()),
+            shadowBlurRadius, (double)shadowMoments.bytes() / (1024 * 1024));
+    }
+    else {
+        printf("Shadow lookups are depth compares, %s PCF kernel\n", PCF_KERNEL_NAMES[shadowKernel]);
+    }
+}
+
+void setShadowMapSize(int size) {
+    GLint maxsize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+    size = std::max(SHADOW_MIN_SIZE, std::min(size, (int)maxsize));
+    if (size == shadowSize) {
+        return;
+    }
+    shadowSize = size;
+    freeFramebuffer();
+    loadFramebuffer();
+    printShadowMapInfo();
+}
+
+void setShadowMapFormat(int format) {
+    if (format == shadowFormat) {
+        return;
+    }
+    shadowFormat = format;
+    freeFramebuffer();
+    loadFramebuffer();
+    printShadowMapInfo();
+}
+
+void setShadowFilter(int filter) {
+    if (filter == shadowFilter) {
+        return;
+    }
+    bool realloc = (filter == SHADOW_FILTER_HARD) != (shadowFilter == SHADOW_FILTER_HARD);
+    shadowFilter = filter;
+    if (realloc) {
+        loadShadowMoments();
+    }
+    invalidateShadowMoments();
+    printShadowMapInfo();
+}
+
+void setShadowMomentFormat(int format) {
+    if (format == shadowMomentFormat) {
+        return;
+    }
+    shadowMomentFormat = format;
+    loadShadowMoments();
+    printShadowMapInfo();
+}
+
+void setShadowKernel(int kernel) {
+    if (kernel == shadowKernel) {
+        return;
+    }
+    bool realloc = (kernel == PCF_PCSS) != (shadowKernel == PCF_PCSS);
+    shadowKernel = kernel;
+    if (realloc) {
+        loadShadowPyramid();
+    }
+    printf("Shadow PCF kernel %s\n", PCF_KERNEL_NAMES[shadowKernel]);
+}
+
+void invalidateShadowMoments() {
+    shadowMomentsStale = (1 << MAX_CASCADES) - 1;
+}
+
+void invalidateShadowPyramid() {
+    shadowPyramidStale = (1 << MAX_CASCADES) - 1;
+}
+
+void setShadowCascades(int count) {
+    count = std::max(1, std::min(count, MAX_CASCADES));
+    if (count == shadowCascades) {
+        return;
+    }
+    shadowCascades = count;
+    freeFramebuffer();
+    loadFramebuffer();
+    printShadowMapInfo();
+}
+
+void setShadowSampleDistribution(bool on) {
+    if (on == shadowSampleDistribution) {
+        return;
+    }
+    shadowSampleDistribution = on;
+    if (on) {
+        loadDepthSamples();
+    }
+    else {
+        freeDepthSamples();
+    }
+    printf("Shadow cascades fitted to %s\n", on ? "the depth samples of the camera" : "the view frustum");
+}
+
+// (re)builds the simplified shadow casters, or frees them for
+// shadowCasterCells 0
+void loadCasterMesh() {
+    casterMesh.free();
+    if (shadowCasterCells <= 0) {
+        printf("Shadow casters: full scene, %d triangles\n", (int)scene.indices.size() / 3);
+        return;
+    }
+    float cellsize = (sceneMax - sceneMin).abs() / shadowCasterCells;
+    castergeometry casters;
+    simplifycasters(scene, cellsize, &casters);
+    casterMesh.upload(casters);
+    printf("Shadow casters: %d of %d triangles, cells of %.3f\n", casterMesh.triangles(),
+        (int)scene.indices.size() / 3, cellsize);
+}
+
+void setShadowCasterCells(int cells) {
+    shadowCasterCells = cells;
+    loadCasterMesh();
+    invalidateShadowCache();
+}
+
+void setContactShadows(bool on) {
+    contactShadows = on;
+    if (!on) {
+        sceneDepth.free();
+    }
+    printf("Contact shadows %s\n", on ? "on" : "off");
 }
 
-Matrix4f getLightView() {
+void setShadowWarp(bool warp) {
+    if (warp == shadowWarp) {
+        return;
+    }
+    shadowWarp = warp;
+    freeFramebuffer();
+    loadFramebuffer();
+    printShadowMapInfo();
+}
+
+void computeSceneBounds() {
+    sceneMin = Vector3f(0, 0, 0);
+    sceneMax = Vector3f(0, 0, 0);
+    if (scene.positions.empty()) {
+        return;
+    }
+    sceneMin = sceneMax = scene.positions[0];
+    for (const Vector3f& p : scene.positions) {
+        for (int k = 0; k < 3; ++k) {
+            sceneMin[k] = std::min(sceneMin[k], p[k]);
+            sceneMax[k] = std::max(sceneMax[k], p[k]);
+        }
+    }
+}
+
+void loadUniformBuffers() {
+    // each view is bound as its own range, which has to be aligned
+    GLint align;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    frameStride = ((GLint)sizeof(frameconstants) + align - 1) / align * align;
+
+    glGenBuffers(1, &frameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, NUM_VIEWS * frameStride, nullptr, GL_DYNAMIC_DRAW);
+
+    // materials never change after loading. pages are bound as ranges
+    // too, and the last one is padded to a whole block.
+    int npages = std::max(1, ((int)scene.materials.size() + MAX_MATERIALS - 1) / MAX_MATERIALS);
+    materialPageStride = ((GLint)(MAX_MATERIALS * sizeof(materialconstants)) + align - 1) /
+        align * align;
+    std::vector<uint8_t> pages(npages * materialPageStride);
+    for (size_t i = 0; i < scene.materials.size(); ++i) {
+        const material& mat = scene.materials[i];
+        Vector3f ambient = mat.ambient;
+        if (ambient.x() <= 0) {
+            ambient = 0.05f * mat.diffuse;
+        }
+        materialconstants& c = ((materialconstants*)&pages[(i / MAX_MATERIALS) *
+            materialPageStride])[i % MAX_MATERIALS];
+        memcpy(c.diffuse, (const float*)mat.diffuse, sizeof(float) * 3);
+        memcpy(c.ambient, (const float*)ambient, sizeof(float) * 3);
+        memcpy(c.specular, (const float*)mat.specular, sizeof(float) * 3);
+        c.diffuse[3] = 1.0f;
+        c.ambient[3] = 0.0f;
+        c.specular[3] = mat.shininess;
+    }
+    glGenBuffers(1, &materialUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, materialUBO);
+    glBufferData(GL_UNIFORM_BUFFER, pages.size(), pages.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK, materialUBO, 0,
+        MAX_MATERIALS * sizeof(materialconstants));
+
+    glGenBuffers(1, &localLightUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, localLightUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(locallightsblock), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LOCAL_LIGHT_BLOCK, localLightUBO);
+}
+
+void freeUniformBuffers() {
+    glDeleteBuffers(1, &frameUBO);
+    glDeleteBuffers(1, &materialUBO);
+    glDeleteBuffers(1, &localLightUBO);
+}
+
+static void setFrameConstants(frameconstants* c, const Matrix4f& V, const Matrix4f& P) {
+    Vector3f eye = V.inverse().getCol(3).xyz();
+    memcpy(c->V, (const float*)V, sizeof(c->V));
+    memcpy(c->P, (const float*)P, sizeof(c->P));
+    for (int i = 0; i < cascades.count; ++i) {
+        Matrix4f light_VP = cascades.projection[i] * cascades.view[i];
+        memcpy(c->light_VP[i], (const float*)light_VP, sizeof(c->light_VP[i]));
+        c->cascadeSplits[i] = cascades.splits[i];
+    }
+    c->cascadeCount = cascades.count;
+    memcpy(c->camPos, (const float*)eye, sizeof(float) * 3);
+    memcpy(c->lightPos, (const float*)light_dir, sizeof(float) * 3);
+    c->lightDiff[0] = c->lightDiff[1] = c->lightDiff[2] = 1.2f;
+}
+
+// picks the local lights in view, sizes their shadow views by screen
+// coverage and brightness, packs them into the atlas and uploads the
+// LocalLights block
+void updateLocalLights(const Matrix4f& V, const Matrix4f& P) {
+    int winw, winh;
+    glfwGetFramebufferSize(window, &winw, &winh);
+
+    // lights in view, most important first
+    struct candidate {
+        int light;
+        float importance;
+    };
+    std::vector<candidate> visible;
+    for (size_t i = 0; i < localLights.size(); ++i) {
+        float coverage = screenCoverage(localLights[i], V, P);
+        if (coverage > 0) {
+            const Vector3f& c = localLights[i].color;
+            float brightness = std::max(c.x(), std::max(c.y(), c.z()));
+            visible.push_back(candidate{ (int)i, coverage * std::min(brightness, 1.0f) });
+        }
+    }
+    std::stable_sort(visible.begin(), visible.end(), [](const candidate& a, const candidate& b) {
+        return a.importance > b.importance;
+    });
+    if ((int)visible.size() > MAX_LOCAL_LIGHTS) {
+        visible.resize(MAX_LOCAL_LIGHTS);
+    }
+    localLightsVisible = (int)visible.size();
+
+    // about as many texels along a tile as the light covers pixels
+    // on screen. lights beyond the view limit get no shadows.
+    localViews.clear();
+    std::vector<int> requests;
+    for (const candidate& c : visible) {
+        const locallight& light = localLights[c.light];
+        int nviews = shadowViewCount(light);
+        if ((int)localViews.size() + nviews > MAX_LOCAL_VIEWS) {
+            break;
+        }
+        for (int face = 0; face < nviews; ++face) {
+            localview v;
+            v.light = c.light;
+            v.face = face;
+            v.view = localLightView(light, face);
+            v.projection = localLightProjection(light);
+            localViews.push_back(v);
+            requests.push_back((int)(c.importance * winh));
+        }
+    }
+    std::vector<shadowtile> tiles;
+    shadowAtlas.pack(requests, &tiles);
+
+    std::vector<shadowtile> held(localLights.size() * 6, shadowtile{ 0, 0, 0 });
+    for (size_t i = 0; i < localViews.size(); ++i) {
+        localview& v = localViews[i];
+        v.tile = tiles[i];
+        size_t key = v.light * 6 + v.face;
+        const shadowtile* before = key < localTilesHeld.size() ? &localTilesHeld[key] : nullptr;
+        v.render = v.tile.size > 0 && (!before || before->size != v.tile.size ||
+            before->x != v.tile.x || before->y != v.tile.y);
+        held[key] = v.tile;
+    }
+    localTilesHeld = held;
+
+    static locallightsblock block;
+    memset(&block, 0, sizeof(block));
+    int firstview = 0;
+    for (const candidate& c : visible) {
+        const locallight& light = localLights[c.light];
+        locallightconstants& l = block.lights[block.count++];
+        memcpy(l.position, (const float*)light.position, sizeof(float) * 3);
+        memcpy(l.direction, (const float*)light.direction, sizeof(float) * 3);
+        memcpy(l.color, (const float*)light.color, sizeof(float) * 3);
+        l.position[3] = light.range;
+        l.direction[3] = light.cone > 0 ? cosf(light.cone) : -1.0f;
+        l.color[3] = light.cone > 0 ? tanf(light.cone) : 1.0f;
+        int nviews = shadowViewCount(light);
+        if (firstview + nviews <= (int)localViews.size()) {
+            l.shadow[0] = firstview;
+            l.shadow[1] = nviews;
+            firstview += nviews;
+        }
+    }
+    float atlas = (float)shadowAtlas.size();
+    for (size_t i = 0; i < localViews.size(); ++i) {
+        const localview& v = localViews[i];
+        Matrix4f VP = v.projection * v.view;
+        memcpy(block.VP[i], (const float*)VP, sizeof(block.VP[i]));
+        block.tiles[i][0] = v.tile.x / atlas;
+        block.tiles[i][1] = v.tile.y / atlas;
+        block.tiles[i][2] = v.tile.size / atlas;
+        block.tiles[i][3] = v.tile.size / atlas;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, localLightUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// allocates the atlas while there are local lights, or frees it
+void loadShadowAtlas() {
+    if (localLightCount == 0) {
+        shadowAtlas.free();
+        return;
+    }
+    if (shadowAtlas.allocated()) {
+        return;
+    }
+    if (!shadowAtlas.allocate(SHADOW_ATLAS_SIZE, SHADOW_DEPTH24)) {
+        printf("Error, incomplete shadow atlas framebuffer\n");
+        exit(-1);
+    }
+}
+
+void setLocalLightCount(int count) {
+    localLightCount = std::max(0, std::min(count, MAX_LOCAL_LIGHTS));
+    localLights = makeLocalLights(sceneMin, sceneMax, localLightCount);
+    localTilesHeld.clear();
+    loadShadowAtlas();
+    printf("%d local lights\n", localLightCount);
+}
+
+// refits the cascades, schedules the stale ones for rendering and
+// writes the constants of all views with a single upload
+void updateFrameConstants() {
+    Matrix4f V = camera.GetViewMatrix();
+    Matrix4f P = camera.GetPerspective();
+    Vector3f shadow_dir = shadowCache.lightDirection(light_dir);
+    if (shadowMapKeyValid && shadowCache.lightKey() != shadowMapKey) {
+        shadowPool.exchange(shadowMapKey, shadowCache.lightKey(), &shadowMap, &shadowCache);
+        // the pool only keeps depth maps
+        invalidateShadowMoments();
+        invalidateShadowPyramid();
+    }
+    shadowMapKey = shadowCache.lightKey();
+    shadowMapKeyValid = true;
+
+    // falls back to the whole frustum until samples with some
+    // geometry in them arrive
+    Matrix4f lightview = getLightView(shadow_dir);
+    shadowcascades fitted;
+    if (shadowSampleDistribution) {
+        readDepthTiles();
+    }
+    if (shadowWarp) {
+        fitWarpedShadowMap(&fitted, V, P, lightview, sceneMin, sceneMax, shadowWarpStrength);
+    }
+    else if (!shadowSampleDistribution || !fitSampledShadowCascades(&fitted, shadowMap.layers(),
+        V, P, lightview, sceneMin, sceneMax, depthTiles, shadowMap.size())) {
+        fitShadowCascades(&fitted, shadowMap.layers(), V, P, lightview,
+            sceneMin, sceneMax, shadowMap.size());
+    }
+
+    // the first cascade draws the full scene, the others the casters
+    int layertriangles[MAX_CASCADES];
+    for (int i = 0; i < fitted.count; ++i) {
+        layertriangles[i] = (int)scene.indices.size() / 3;
+        if (i > 0 && casterMesh.uploaded()) {
+            layertriangles[i] = casterMesh.triangles();
+        }
+    }
+    shadowUpdateMask = shadowCache.update(fitted, layertriangles, shadowTriangleBudget,
+        shadowAmortize);
+    // shade with what the layers hold, which lags behind for
+    // cascades whose refresh was postponed
+    cascades = shadowCache.rendered();
+
+    static std::vector<uint8_t> data;
+    data.resize(NUM_VIEWS * frameStride);
+    setFrameConstants((frameconstants*)&data[VIEW_CAMERA * frameStride], V, P);
+    setFrameConstants((frameconstants*)&data[VIEW_SCREEN * frameStride],
+        Matrix4f::identity(), Matrix4f::identity());
+    for (int i = 0; i < cascades.count; ++i) {
+        setFrameConstants((frameconstants*)&data[(VIEW_CASCADE0 + i) * frameStride],
+            cascades.view[i], cascades.projection[i]);
+    }
+    updateLocalLights(V, P);
+    for (size_t i = 0; i < localViews.size(); ++i) {
+        setFrameConstants((frameconstants*)&data[(VIEW_LOCAL0 + i) * frameStride],
+            localViews[i].view, localViews[i].projection);
+    }
+    // views past the last local one are unused
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, (VIEW_LOCAL0 + localViews.size()) * frameStride,
+        data.data());
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void bindFrameConstants(int view) {
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK, frameUBO,
+        view * frameStride, sizeof(frameconstants));
+}
+
+void invalidateShadowCache() {
+    shadowCache.invalidate();
+    shadowPool.clear();
+    localTilesHeld.clear();
+}
+
+void setShadowPoolBudget(size_t bytes) {
+    shadowPoolBudget = bytes;
+    shadowPool.setBudget(bytes);
+    printf("Shadow map pool budget %.1f MB\n", (double)bytes / (1024 * 1024));
+}
+
+void setShadowCacheAngle(float degrees) {
+    shadowCache.setAngleThreshold(degrees);
+    printf("Shadow map is rendered again when the light turns by %.3f degrees\n", degrees);
+}
+
+void printFrameStats() {
+    printShadowMapInfo();
+    int hits = shadowCache.hits();
+    int misses = shadowCache.misses();
+    printf("Shadow cache: %d hits, %d misses (%.1f%% hit rate)\n", hits, misses,
+        hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    printf("Shadow updates: %d cascades rendered, %d postponed, budget %d triangles%s\n",
+        shadowCache.layersRendered(), shadowCache.layersDeferred(),
+        shadowTriangleBudget, shadowAmortize ? "" : " (not amortized)");
+    printf("Shadow map pool: %d maps, %.1f of %.1f MB, %d reused, %d rendered anew\n",
+        shadowPool.size(), (double)shadowPool.bytes() / (1024 * 1024),
+        (double)shadowPool.budget() / (1024 * 1024), shadowPool.hits(), shadowPool.misses());
+    printf("Cascade splits at");
+    for (int i = 0; i < cascades.count; ++i) {
+        printf(" %.2f", cascades.splits[i]);
+    }
+    printf("%s\n", shadowSampleDistribution && !shadowWarp ? ", fitted to depth samples" : "");
+    if (sceneDepth.allocated()) {
+        printf("Contact shadows: rays of %.3f, scene depth %dx%d, %.1f MB\n", contactShadowLength,
+            sceneDepth.width(), sceneDepth.height(), (double)sceneDepth.bytes() / (1024 * 1024));
+    }
+    printf("Local lights: %d of %d in view, %d shadow views, %d rendered last frame\n",
+        localLightsVisible, (int)localLights.size(), (int)localViews.size(), localViewsRendered);
+    if (shadowAtlas.allocated()) {
+        printf("Shadow atlas %dx%d, %.1f MB\n", shadowAtlas.size(), shadowAtlas.size(),
+            (double)shadowAtlas.bytes() / (1024 * 1024));
+    }
+    printf("Streamed %d vertex bytes last frame\n", (int)frame_streamed_bytes);
+}
+
+// Draws the light pass a few times with every PCF kernel and prints
+// its GPU time next to the mean difference from the 25 tap kernel,
+// in 8 bit color steps per channel. Only meaningful with hard shadow
+// lookups, the filterable modes ignore the kernel.
+void benchmarkShadowKernels() {
+    const int RUNS = 10;
+    int winw, winh;
+    glfwGetFramebufferSize(window, &winw, &winh);
+    std::vector<std::vector<uint8_t>> images(NUM_PCF_KERNELS);
+    double ms[NUM_PCF_KERNELS];
+
+    GLuint query;
+    glGenQueries(1, &query);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    // PCSS is among the kernels, so it needs a pyramid for a while
+    bool haspyramid = shadowPyramid.allocated();
+    if (!haspyramid) {
+        shadowPyramid.allocate(shadowMap.size(), shadowMap.layers());
+        invalidateShadowPyramid();
+    }
+    buildShadowPyramid(shadowPyramidStale);
+    shadowPyramidStale = 0;
+    for (int k = 0; k < NUM_PCF_KERNELS; ++k) {
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        for (int i = 0; i < RUNS; ++i) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            drawLightPass(k);
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+        GLuint64 ns;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        ms[k] = ns / 1e6 / RUNS;
+
+        images[k].resize((size_t)winw * winh * 3);
+        glReadPixels(0, 0, winw, winh, GL_RGB, GL_UNSIGNED_BYTE, images[k].data());
+    }
+    glDeleteQueries(1, &query);
+    if (!haspyramid) {
+        shadowPyramid.free();
+    }
+
+    const std::vector<uint8_t>& reference = images[PCF_GRID_25];
+    printf("Shadow PCF kernels, %dx%d, %s lookups:\n", winw, winh,
+        shadowMoments.allocated() ? "filtered moment" : "depth compare");
+    for (int k = 0; k < NUM_PCF_KERNELS; ++k) {
+        double error = 0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            error += std::abs((int)images[k][i] - (int)reference[i]);
+        }
+        error /= std::max((size_t)1, reference.size());
+        printf("  %-12s %7.3f ms  %6.3f difference%s\n", PCF_KERNEL_NAMES[k], ms[k], error,
+            k == shadowKernel ? "  (current)" : "");
+    }
+}
+
+Matrix4f getLightView(const Vector3f& dir) {
   Vector3f center(0,0,0);
-  Vector3f up(light_dir.z(), light_dir.z(), -light_dir.x() - light_dir.y());
+  Vector3f up(dir.z(), dir.z(), -dir.x() - dir.y());
   up.normalize();
-  Vector3f eye( light_dir * 50.0f);
+  Vector3f eye( dir * 50.0f);
 
   return Matrix4f::lookAt( eye, center, up);
 }
 
-Matrix4f getLightProjection() {
-  return Matrix4f::orthographicProjection(64, 64, 8, 100, false);
-}
-
 // Main routine.
 // Set up OpenGL, define the callbacks and start the main loop
 int main(int argc, char* argv[])
@@ -240,8 +1293,6 @@ int main(int argc, char* argv[])
         return -1;
     }
     
-    rec = VertexRecorder();
-    
     window = createOpenGLWindow(1024, 1024, "Assignment 5");
     
     // setup the event handlers
@@ -256,8 +1307,16 @@ int main(int argc, char* argv[])
     glEnable(GL_BLEND);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
+    computeSceneBounds();
     loadTextures();
     loadFramebuffer();
+    printShadowMapInfo();
+    shadowPool.setBudget(shadowPoolBudget);
+    loadShadowAtlas();
+    localLights = makeLocalLights(sceneMin, sceneMax, localLightCount);
+    loadUniformBuffers();
+    sceneMesh.upload(scene);
+    loadCasterMesh();
     
     camera.SetDimensions(600, 600);
     camera.SetPerspective(50);
@@ -265,31 +1324,36 @@ int main(int argc, char* argv[])
     camera.SetCenter(Vector3f(0, 1, 0));
     camera.SetRotation(Matrix4f::rotateY(1.6f) * Matrix4f::rotateZ(0.4f));
     
+    // compile the shaders once; afterwards they are only
+    // rebuilt when a shader file changes
+    loadPrograms(basepath);
+
     // set timer for animations
     timer.set();
     while (!glfwWindowShouldClose(window)) {
         setViewportWindow(window);
         
-        // we reload the shader files each frame.
-        // this shaders can be edited while the program is running
-        // loadPrograms/freePrograms is implemented in main.h
-        bool valid_shaders = loadPrograms(basepath);
+        // shader files are polled for changes and rebuilt when edited,
+        // so they can be changed while the program is running.
+        // loadPrograms/reloadChangedPrograms is implemented in main.h
+        bool valid_shaders = reloadChangedPrograms(basepath);
         if (valid_shaders) {
             
+            // update animation
+            updateLightDirection();
+            updateFrameConstants();
+            
             // draw coordinate axes
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             if (gMousePressed) {
                 drawAxis();
             }
             
-            // update animation
-            updateLightDirection();
-            
             // draw everything
             draw();
         }
-        // make sure to release the shader programs.
-        freePrograms();
+        frame_streamed_bytes = VertexRecorder::streamedBytes();
+        VertexRecorder::resetStreamCounter();
         
         // Make back buffer visible
         glfwSwapBuffers(window);
@@ -300,7 +1364,15 @@ int main(int argc, char* argv[])
     
     // All OpenGL resource that are created with
     // glGen* or glCreate* must be freed.
+    freePrograms();
+    sceneMesh.free();
+    casterMesh.free();
+    VertexRecorder::freeStream();
+    freeUniformBuffers();
     freeFramebuffer();
+    freeDepthSamples();
+    sceneDepth.free();
+    shadowAtlas.free();
     freeTextures();
     
     glfwDestroyWindow(window);
@@ -9,15 +9,98 @@
 #include "vecmath.h"
 #include "vertexrecorder.h"
 #include "camera.h"
+#include "shadowmap.h"
+#include "locallights.h"
 
 // globals
 GLFWwindow* window;
 
+// binding points of the uniform blocks shared by all programs
+enum { FRAME_BLOCK = 0, MATERIAL_BLOCK = 1, LOCAL_LIGHT_BLOCK = 2 };
+
+// shadow map settings, see setShadowMapSize() and friends
+extern int shadowSize;
+extern int shadowFormat;
+extern int shadowCascades;
+extern bool shadowLayered;
+extern ShadowCache shadowCache;
+extern bool shadowAmortize;
+extern int shadowTriangleBudget;
+extern size_t shadowPoolBudget;
+extern int shadowFilter;
+extern int shadowMomentFormat;
+extern int shadowBlurRadius;
+extern float shadowLightBleed;
+extern float shadowEvsmExponent;
+extern bool shadowWarp;
+extern bool shadowSampleDistribution;
+extern bool contactShadows;
+extern float contactShadowLength;
+extern int shadowCasterCells;
+extern float shadowWarpStrength;
+
+// per-view ranges of the frame constants buffer, see bindFrameConstants()
+enum {
+    VIEW_CAMERA,
+    VIEW_SCREEN,
+    VIEW_CASCADE0, // one light view per cascade
+    VIEW_LOCAL0 = VIEW_CASCADE0 + MAX_CASCADES, // shadow views of local lights
+    NUM_VIEWS = VIEW_LOCAL0 + MAX_LOCAL_VIEWS
+};
+
+// kernels of the shadow depth compare, one program variant each.
+// must match PCF_* in fragmentshader_dirlight.glsl
+enum {
+    PCF_GRID_1, PCF_GRID_4, PCF_GRID_9, PCF_GRID_16, PCF_GRID_25,
+    PCF_POISSON, PCF_GATHER, PCF_PCSS, NUM_PCF_KERNELS
+};
+const char* PCF_KERNEL_NAMES[NUM_PCF_KERNELS] = {
+    "1 tap", "4 taps", "9 taps", "16 taps", "25 taps", "poisson 16", "gather 4x4", "PCSS"
+};
+extern int shadowKernel;
+extern float shadowLightAngle;
+extern int localLightCount;
+
+// locations of the per-draw uniforms of a program.
+// looked up once after linking; -1 if the program does not use one.
+struct programuniforms {
+    GLint M;
+    GLint N;
+    GLint materialIndex;
+    GLint layer;
+    GLint layerMask;
+    GLint shadowFilter;
+    GLint lightBleed;
+    GLint evsmExponent;
+    GLint blurPass;
+    GLint blurRadius;
+    GLint level;
+    GLint skipEmpty;
+    GLint lightTanAngle;
+    GLint contactLength;
+    GLint sceneScale;
+};
+
 // shader programs
 // see loadPrograms() and freePrograms()
 GLuint program_quad;
 GLuint program_color;
-GLuint program_light;
+GLuint program_light[NUM_PCF_KERNELS]; // one per PCF kernel
+GLuint program_depth;
+GLuint program_depth_layered;
+GLuint program_layerquad;
+GLuint program_moments;
+GLuint program_minmax;
+programuniforms uniforms_quad;
+programuniforms uniforms_color;
+programuniforms uniforms_light[NUM_PCF_KERNELS];
+programuniforms uniforms_depth;
+programuniforms uniforms_depth_layered;
+programuniforms uniforms_layerquad;
+programuniforms uniforms_moments;
+programuniforms uniforms_minmax;
+// shader files the programs were built from
+filewatcher shaderWatcher;
 
 // camera and coordinate axes
 bool gMousePressed = false;
@@ -29,18 +112,46 @@ void mouseCallback(GLFWwindow* window, int button, int action, int mods);
 void motionCallback(GLFWwindow* window, double x, double y);
 
 void drawAxis();
+// prints per-frame statistics; implemented in main.cpp
+void printFrameStats();
+// reallocate the shadow map; implemented in main.cpp
+void setShadowMapSize(int size);
+void setShadowMapFormat(int format);
+void setShadowCascades(int count);
+void setShadowWarp(bool warp);
+void setShadowSampleDistribution(bool on);
+void setContactShadows(bool on);
+// rebuilds the simplified shadow casters, see loadCasterMesh()
+void setShadowCasterCells(int cells);
+void setShadowCacheAngle(float degrees);
+void setShadowPoolBudget(size_t bytes);
+void setShadowFilter(int filter);
+void setShadowMomentFormat(int format);
+void setShadowKernel(int kernel);
+// recomputes the moments with the current blur and exponent
+void invalidateShadowMoments();
+// rebuilds the min/max depth pyramid of all layers
+void invalidateShadowPyramid();
+// replaces the local lights with count new ones
+void setLocalLightCount(int count);
+// forces the shadow map to be rendered again; implemented in main.cpp
+void invalidateShadowCache();
+// times the light pass with every PCF kernel; implemented in main.cpp
+void benchmarkShadowKernels();
 void drawTexturedQuad(GLint texture);
+void drawShadowMapLayer(GLint texture, int layer);
 void setViewportWindow(GLFWwindow* window);
 
-void updateMaterialUniforms(GLuint program, Vector3f diffuseColor,
-    Vector3f ambientColor = Vector3f(-1, -1, -1),
-    Vector3f specularColor = Vector3f(0, 0, 0),
-    float shininess = 1.0f,
-    float alpha = 1.0f);
-void updateLightUniforms(GLuint program, Vector3f pos, Vector3f color = Vector3f(1, 1, 1));
-void updateTransformUniforms(uint32_t program, Matrix4f M, Matrix4f V, Matrix4f P);
+// binds the frame constants of one view (VIEW_*) to FRAME_BLOCK.
+// implemented in main.cpp
+void bindFrameConstants(int view);
+void updateModelUniforms(const programuniforms& uniforms, Matrix4f M);
 
+// (re)builds all programs. a program that fails to build keeps
+// its last working version. return false if any program is missing.
 bool loadPrograms(const std::string & basepath);
+// calls loadPrograms() only if a shader file changed on disk
+bool reloadChangedPrograms(const std::string & basepath);
 void freePrograms();
 
 class glfwtimer {
@@ -67,7 +178,8 @@ public:
 // draw a texture onto the screen
 void drawTexturedQuad(GLint tex) {
     glUseProgram(program_quad);
-    updateTransformUniforms(program_quad, Matrix4f::identity(), Matrix4f::identity(), Matrix4f::identity());
+    bindFrameConstants(VIEW_SCREEN);
+    updateModelUniforms(uniforms_quad, Matrix4f::identity());
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, tex);
@@ -79,6 +191,23 @@ void drawTexturedQuad(GLint tex) {
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+// draw one layer of a depth texture array onto the screen
+void drawShadowMapLayer(GLint tex, int layer) {
+    glUseProgram(program_layerquad);
+    bindFrameConstants(VIEW_SCREEN);
+    updateModelUniforms(uniforms_layerquad, Matrix4f::identity());
+    glUniform1i(uniforms_layerquad.layer, layer);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+
+    glDisable(GL_DEPTH_TEST);
+    drawUnitQuad();
+
+    glEnable(GL_DEPTH_TEST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
 void setViewportWindow(GLFWwindow* window)
 {
     int w, h;
@@ -91,6 +220,88 @@ void setViewportWindow(GLFWwindow* window)
 
 
 
+// looks up the uniforms of a freshly linked program and sets
+// the state that never changes: block bindings and sampler units.
+programuniforms reflectProgram(GLuint program) {
+    GLuint block = glGetUniformBlockIndex(program, "FrameConstants");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, FRAME_BLOCK);
+    }
+    block = glGetUniformBlockIndex(program, "Materials");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, MATERIAL_BLOCK);
+    }
+    block = glGetUniformBlockIndex(program, "LocalLights");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, LOCAL_LIGHT_BLOCK);
+    }
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "diffuseTex"), 0);
+    glUniform1i(glGetUniformLocation(program, "shadowTex"), 1);
+    glUniform1i(glGetUniformLocation(program, "momentTex"), 2);
+    glUniform1i(glGetUniformLocation(program, "blurTex"), 0);
+    glUniform1i(glGetUniformLocation(program, "pyramidTex"), 3);
+    glUniform1i(glGetUniformLocation(program, "shadowDepthTex"), 4);
+    glUniform1i(glGetUniformLocation(program, "atlasTex"), 5);
+    glUniform1i(glGetUniformLocation(program, "sceneDepthTex"), 6);
+    glUseProgram(0);
+
+    programuniforms uniforms;
+    uniforms.M = glGetUniformLocation(program, "M");
+    uniforms.N = glGetUniformLocation(program, "N");
+    uniforms.materialIndex = glGetUniformLocation(program, "materialIndex");
+    uniforms.layer = glGetUniformLocation(program, "layer");
+    uniforms.layerMask = glGetUniformLocation(program, "layerMask");
+    uniforms.shadowFilter = glGetUniformLocation(program, "shadowFilter");
+    uniforms.lightBleed = glGetUniformLocation(program, "lightBleed");
+    uniforms.evsmExponent = glGetUniformLocation(program, "evsmExponent");
+    uniforms.blurPass = glGetUniformLocation(program, "blurPass");
+    uniforms.blurRadius = glGetUniformLocation(program, "blurRadius");
+    uniforms.level = glGetUniformLocation(program, "level");
+    uniforms.skipEmpty = glGetUniformLocation(program, "skipEmpty");
+    uniforms.lightTanAngle = glGetUniformLocation(program, "lightTanAngle");
+    uniforms.contactLength = glGetUniformLocation(program, "contactLength");
+    uniforms.sceneScale = glGetUniformLocation(program, "sceneScale");
+    return uniforms;
+}
+
+// compiles vshader/fshader into a new program. on success the old
+// program is replaced, otherwise it stays in place. defines select
+// a variant of the shaders, see compileProgramFromFile().
+bool rebuildProgram(GLuint& program, programuniforms& uniforms,
+    const std::string& vshader, const std::string& fshader,
+    const std::string& gshader = "", const std::string& defines = "") {
+    shaderWatcher.watch(vshader);
+    shaderWatcher.watch(fshader);
+    if (!gshader.empty()) {
+        shaderWatcher.watch(gshader);
+    }
+    GLuint rebuilt = compileProgramFromFile(vshader.c_str(), fshader.c_str(),
+        gshader.empty() ? nullptr : gshader.c_str(), defines.empty() ? nullptr : defines.c_str());
+    if (!rebuilt) {
+        printf("Cannot compile program %s\n", fshader.c_str());
+        if (program) {
+            printf("Keeping the last working version\n");
+        }
+        return false;
+    }
+    glDeleteProgram(program);
+    program = rebuilt;
+    uniforms = reflectProgram(program);
+    return true;
+}
+
+bool programsLoaded() {
+    for (int k = 0; k < NUM_PCF_KERNELS; ++k) {
+        if (!program_light[k]) {
+            return false;
+        }
+    }
+    return program_color && program_quad && program_depth &&
+        program_layerquad && program_depth_layered && program_moments && program_minmax;
+}
+
 bool loadPrograms(const std::string & basepath) {
     // The program object controls the programmable parts
     // of OpenGL. All OpenGL programs define a vertex shader
@@ -99,76 +310,58 @@ bool loadPrograms(const std::string & basepath) {
     std::string fshader_light = basepath + "shaders/fragmentshader_dirlight.glsl";
     std::string fshader_color = basepath + "shaders/fragmentshader_color.glsl";
     std::string fshader_quad = basepath + "shaders/diffuse_nolight.glsl";
-    program_color = compileProgramFromFile(vshader.c_str(), fshader_color.c_str());
-    if (!program_color) {
-        printf("Cannot compile program\n");
-        return false;
+    std::string vshader_depth = basepath + "shaders/vertexshader_depth.glsl";
+    std::string fshader_depth = basepath + "shaders/fragmentshader_depth.glsl";
+    std::string fshader_layerquad = basepath + "shaders/depth_layer.glsl";
+    std::string vshader_layered = basepath + "shaders/vertexshader_depth_layered.glsl";
+    std::string gshader_layered = basepath + "shaders/geometryshader_depth_layered.glsl";
+    std::string fshader_moments = basepath + "shaders/shadow_moments.glsl";
+    std::string fshader_minmax = basepath + "shaders/shadow_minmax.glsl";
+    rebuildProgram(program_color, uniforms_color, vshader, fshader_color);
+    for (int k = 0; k < NUM_PCF_KERNELS; ++k) {
+        std::string defines = "#define PCF_KERNEL " + std::to_string(k) + "\n";
+        rebuildProgram(program_light[k], uniforms_light[k], vshader, fshader_light, "", defines);
     }
-    program_light = compileProgramFromFile(vshader.c_str(), fshader_light.c_str());
-    if (!program_light) {
-        printf("Cannot compile program\n");
-        return false;
-    }
-    program_quad = compileProgramFromFile(vshader.c_str(), fshader_quad.c_str());
-    if (!program_quad) {
-        printf("Cannot compile program\n");
-        return false;
-    }
-    return true;
-}
-void freePrograms() {
-    glDeleteProgram(program_color); program_color = 0;
-    glDeleteProgram(program_light); program_light = 0;
-    glDeleteProgram(program_quad); program_quad = 0;
+    rebuildProgram(program_quad, uniforms_quad, vshader, fshader_quad);
+    rebuildProgram(program_depth, uniforms_depth, vshader_depth, fshader_depth);
+    rebuildProgram(program_layerquad, uniforms_layerquad, vshader, fshader_layerquad);
+    rebuildProgram(program_depth_layered, uniforms_depth_layered,
+        vshader_layered, fshader_depth, gshader_layered);
+    rebuildProgram(program_moments, uniforms_moments, vshader, fshader_moments);
+    rebuildProgram(program_minmax, uniforms_minmax, vshader, fshader_minmax);
+    // the depth shaders may have changed
+    invalidateShadowCache();
+    invalidateShadowMoments();
+    invalidateShadowPyramid();
+    return programsLoaded();
 }
 
-void updateMaterialUniforms(GLuint program, Vector3f diffuseColor,
-    Vector3f ambientColor,
-    Vector3f specularColor,
-    float shininess,
-    float alpha) {
-    int loc = glGetUniformLocation(program, "diffColor");
-    glUniform3fv(loc, 1, diffuseColor);
-    if (ambientColor.x() <= 0) {
-        ambientColor = 0.05f * diffuseColor;
+bool reloadChangedPrograms(const std::string & basepath) {
+    if (shaderWatcher.poll()) {
+        printf("Shaders changed, reloading\n");
+        loadPrograms(basepath);
     }
-    loc = glGetUniformLocation(program, "ambientColor");
-    glUniform3fv(loc, 1, ambientColor);
-    loc = glGetUniformLocation(program, "specColor");
-    glUniform3fv(loc, 1, specularColor);
-    loc = glGetUniformLocation(program, "shininess");
-    glUniform1f(loc, shininess);
-    loc = glGetUniformLocation(program, "alpha");
-    glUniform1f(loc, alpha);
+    return programsLoaded();
 }
 
-void updateLightUniforms(GLuint program, Vector3f pos, Vector3f color) {
-    int loc = glGetUniformLocation(program, "lightPos");
-    glUniform3fv(loc, 1, pos);
-
-    loc = glGetUniformLocation(program, "lightDiff");
-    glUniform3fv(loc, 1, color);
+void freePrograms() {
+    glDeleteProgram(program_color); program_color = 0;
+    for (int k = 0; k < NUM_PCF_KERNELS; ++k) {
+        glDeleteProgram(program_light[k]); program_light[k] = 0;
+    }
+    glDeleteProgram(program_quad); program_quad = 0;
+    glDeleteProgram(program_depth); program_depth = 0;
+    glDeleteProgram(program_layerquad); program_layerquad = 0;
+    glDeleteProgram(program_depth_layered); program_depth_layered = 0;
+    glDeleteProgram(program_moments); program_moments = 0;
+    glDeleteProgram(program_minmax); program_minmax = 0;
+    shaderWatcher.clear();
 }
 
-void updateTransformUniforms(uint32_t program, Matrix4f M, Matrix4f V, Matrix4f P) {
-    Matrix4f C = V.inverse();
-    Vector3f eye = C.getCol(3).xyz();
-
-    int loc = glGetUniformLocation(program, "P");
-    glUniformMatrix4fv(loc, 1, false, P);
-
-    loc = glGetUniformLocation(program, "V");
-    glUniformMatrix4fv(loc, 1, false, V);
-
-    loc = glGetUniformLocation(program, "camPos");
-    glUniform3fv(loc, 1, eye);
-
-    loc = glGetUniformLocation(program, "M");
-    glUniformMatrix4fv(loc, 1, false, M);
-
+void updateModelUniforms(const programuniforms& uniforms, Matrix4f M) {
+    glUniformMatrix4fv(uniforms.M, 1, false, M);
     Matrix4f N = M.inverse().transposed();
-    loc = glGetUniformLocation(program, "N");
-    glUniformMatrix4fv(loc, 1, false, N);
+    glUniformMatrix4fv(uniforms.N, 1, false, N);
 }
 
 
@@ -193,6 +386,131 @@ void keyCallback(GLFWwindow* window, int key,
         camera.SetCenter(Vector3f(0, 0, 0));
         break;
     }
+    case 'I':
+        printFrameStats();
+        break;
+    case '[':
+        setShadowMapSize(shadowSize / 2);
+        break;
+    case ']':
+        setShadowMapSize(shadowSize * 2);
+        break;
+    case 'F':
+        setShadowMapFormat((shadowFormat + 1) % NUM_SHADOW_FORMATS);
+        break;
+    case 'C':
+        setShadowCascades(shadowCascades % MAX_CASCADES + 1);
+        break;
+    case 'W':
+        setShadowWarp(!shadowWarp);
+        break;
+    case 'D':
+        setShadowSampleDistribution(!shadowSampleDistribution);
+        break;
+    case 'H':
+        setContactShadows(!contactShadows);
+        break;
+    case 'X':
+        // cycles 1024, 512, 256 and 128 cells across the scene, then
+        // the full scene
+        setShadowCasterCells(shadowCasterCells == 0 ? 1024 :
+            (shadowCasterCells > 128 ? shadowCasterCells / 2 : 0));
+        break;
+    case '9':
+        contactShadowLength = std::max(0.0625f, contactShadowLength / 2);
+        printf("Contact shadow length %.3f\n", contactShadowLength);
+        break;
+    case '0':
+        contactShadowLength = std::min(4.0f, contactShadowLength * 2);
+        printf("Contact shadow length %.3f\n", contactShadowLength);
+        break;
+    case 'E':
+        shadowWarpStrength = std::max(0.0f, shadowWarpStrength - 0.25f);
+        printf("Shadow warp strength %.2f\n", shadowWarpStrength);
+        break;
+    case 'R':
+        shadowWarpStrength = std::min(4.0f, shadowWarpStrength + 0.25f);
+        printf("Shadow warp strength %.2f\n", shadowWarpStrength);
+        break;
+    case '-':
+        setShadowCacheAngle(shadowCache.angleThreshold() / 2);
+        break;
+    case '=':
+        setShadowCacheAngle(shadowCache.angleThreshold() * 2);
+        break;
+    case 'A':
+        shadowAmortize = !shadowAmortize;
+        printf("Shadow updates %s\n", shadowAmortize ? "amortized over frames" : "not amortized");
+        break;
+    case ',':
+        if (shadowTriangleBudget > 1) {
+            shadowTriangleBudget /= 2;
+        }
+        printf("Shadow budget %d triangles per frame\n", shadowTriangleBudget);
+        break;
+    case '.':
+        shadowTriangleBudget *= 2;
+        printf("Shadow budget %d triangles per frame\n", shadowTriangleBudget);
+        break;
+    case 'P':
+        // cycles 0, 16, 32, ... 256 MB
+        setShadowPoolBudget(shadowPoolBudget >= 256 * 1024 * 1024 ? 0 :
+            (shadowPoolBudget ? shadowPoolBudget * 2 : 16 * 1024 * 1024));
+        break;
+    case 'V':
+        setShadowFilter((shadowFilter + 1) % NUM_SHADOW_FILTERS);
+        break;
+    case 'M':
+        setShadowMomentFormat((shadowMomentFormat + 1) % NUM_MOMENT_FORMATS);
+        break;
+    case 'B':
+        // cycles 0 (no blur) to 4 texels
+        shadowBlurRadius = (shadowBlurRadius + 1) % 5;
+        printf("Shadow blur radius %d texels\n", shadowBlurRadius);
+        invalidateShadowMoments();
+        break;
+    case 'J':
+        shadowLightBleed = std::max(0.0f, shadowLightBleed - 0.05f);
+        printf("Shadow light bleed reduction %.2f\n", shadowLightBleed);
+        break;
+    case 'K':
+        shadowLightBleed = std::min(0.95f, shadowLightBleed + 0.05f);
+        printf("Shadow light bleed reduction %.2f\n", shadowLightBleed);
+        break;
+    case ';':
+        shadowEvsmExponent = std::max(1.0f, shadowEvsmExponent / 2);
+        printf("EVSM exponent %.1f\n", shadowEvsmExponent);
+        invalidateShadowMoments();
+        break;
+    case '\'':
+        shadowEvsmExponent = std::min(shadowEvsmExponent * 2,
+            ShadowMoments::maxExponent(shadowMomentFormat));
+        printf("EVSM exponent %.1f\n", shadowEvsmExponent);
+        invalidateShadowMoments();
+        break;
+    case 'O':
+        setShadowKernel((shadowKernel + 1) % NUM_PCF_KERNELS);
+        break;
+    case 'Y':
+        shadowLightAngle = std::max(0.125f, shadowLightAngle / 2);
+        printf("Light angular radius %.3f degrees\n", shadowLightAngle);
+        break;
+    case 'U':
+        shadowLightAngle = std::min(8.0f, shadowLightAngle * 2);
+        printf("Light angular radius %.3f degrees\n", shadowLightAngle);
+        break;
+    case 'G':
+        // cycles 0, 4, 8, ... 32 lights
+        setLocalLightCount(localLightCount >= MAX_LOCAL_LIGHTS ? 0 :
+            (localLightCount ? localLightCount * 2 : 4));
+        break;
+    case 'T':
+        benchmarkShadowKernels();
+        break;
+    case 'L':
+        shadowLayered = !shadowLayered;
+        printf("Shadow cascades rendered in %s\n", shadowLayered ? "one layered pass" : "one pass each");
+        break;
     default:
         std::cout << "Unhandled key press " << key << "." << std::endl;
     }
@@ -238,8 +556,9 @@ void motionCallback(GLFWwindow* window, double x, double y)
 void drawAxis()
 {
     glUseProgram(program_color);
+    bindFrameConstants(VIEW_CAMERA);
     Matrix4f M = Matrix4f::translation(camera.GetCenter()).inverse();
-    updateTransformUniforms(program_color, M, camera.GetViewMatrix(), camera.GetPerspective());
+    updateModelUniforms(uniforms_color, M);
 
     const Vector3f DKRED(1.0f, 0.5f, 0.5f);
     const Vector3f DKGREEN(0.5f, 1.0f, 0.5f);
@@ -251,7 +570,8 @@ void drawAxis()
     const Vector3f AXISY(0, 5, 0);
     const Vector3f AXISZ(0, 0, 5);
 
-    VertexRecorder recorder;
+    static VertexRecorder recorder;
+    recorder.clear();
     recorder.record_poscolor(ORGN, DKRED);
     recorder.record_poscolor(AXISX, DKRED);
     recorder.record_poscolor(ORGN, DKGREEN);
@@ -0,0 +1,118 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mappedfile::mappedfile() :
+    m_data(nullptr),
+    m_size(0)
+#ifdef _WIN32
+    , m_file(nullptr),
+    m_mapping(nullptr)
+#endif
+{
+}
+
+mappedfile::~mappedfile()
+{
+    close();
+}
+
+#ifdef _WIN32
+bool mappedfile::open(const std::string& fname)
+{
+    close();
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_file = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        close();
+        return false;
+    }
+    m_size = (size_t)size.QuadPart;
+    if (m_size == 0) {
+        // empty files cannot be mapped
+        m_data = "";
+        return true;
+    }
+    m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) {
+        close();
+        return false;
+    }
+    m_data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void mappedfile::close()
+{
+    if (m_data && m_size) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_mapping = nullptr;
+    m_file = nullptr;
+}
+#else
+bool mappedfile::open(const std::string& fname)
+{
+    close();
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    m_size = (size_t)st.st_size;
+    if (m_size == 0) {
+        // empty files cannot be mapped
+        ::close(fd);
+        m_data = "";
+        return true;
+    }
+    void* addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        m_size = 0;
+        return false;
+    }
+    madvise(addr, m_size, MADV_SEQUENTIAL);
+    m_data = (const char*)addr;
+    return true;
+}
+
+void mappedfile::close()
+{
+    if (m_data && m_size) {
+        munmap((void*)m_data, m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+// read-only view of the contents of a whole file.
+// The file is memory-mapped, so data() points straight into the page
+// cache and nothing is copied until it is touched.
+class mappedfile {
+public:
+    mappedfile();
+    ~mappedfile();
+
+    // return false if the file cannot be opened or mapped
+    bool open(const std::string& fname);
+    void close();
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    mappedfile(const mappedfile&);
+    mappedfile& operator=(const mappedfile&);
+
+    const char* m_data;
+    size_t m_size;
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+};
+
+#endif
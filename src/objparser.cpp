@@ -1,10 +1,13 @@
 #include "objparser.h"
 
-#include <fstream>
 #include <cstdio>
-#include <sstream>
-#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
+#include "mappedfile.h"
+#include "scenecache.h"
+#include "workerpool.h"
 #include "stb_image.h"
 
 
@@ -15,16 +18,557 @@ void objparser::clear() {
     indices.clear();
     textures.clear();
     batches.clear();
+    materials.clear();
+    sourcefiles.clear();
+}
+
+// ---------------------------------------------------------------------
+// In-place tokenizer used by the OBJ and MTL parsers.
+// All functions scan a line [p, end) without copying it and return the
+// position after the consumed characters, or nullptr on a syntax error.
+
+static inline bool isblank_(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* skipblank(const char* p, const char* end) {
+    while (p < end && isblank_(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// reads a whitespace-delimited token into [*tok, *tok + *len)
+static const char* scantoken(const char* p, const char* end, const char** tok, size_t* len) {
+    p = skipblank(p, end);
+    const char* start = p;
+    while (p < end && !isblank_(*p)) {
+        ++p;
+    }
+    *tok = start;
+    *len = p - start;
+    return p;
+}
+
+static inline bool tokeneq(const char* tok, size_t len, const char* lit) {
+    return strlen(lit) == len && memcmp(tok, lit, len) == 0;
+}
+
+static const char* scanstring(const char* p, const char* end, std::string* out) {
+    const char* tok;
+    size_t len;
+    p = scantoken(p, end, &tok, &len);
+    out->assign(tok, len);
+    return p;
+}
+
+static const char* scanuint(const char* p, const char* end, uint32_t* out) {
+    p = skipblank(p, end);
+    if (p == end || *p < '0' || *p > '9') {
+        return nullptr;
+    }
+    uint32_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        ++p;
+    }
+    *out = v;
+    return p;
+}
+
+static const char* scanfloat(const char* p, const char* end, float* out) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+        1e21, 1e22
+    };
+    p = skipblank(p, end);
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        ++p;
+    }
+    // accumulate up to 18 significant digits in an integer mantissa
+    uint64_t mant = 0;
+    int ndigits = 0;
+    int exp10 = 0;
+    bool any = false;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (ndigits < 18) {
+            mant = mant * 10 + (*p - '0');
+            ndigits += mant != 0;
+        }
+        else {
+            exp10++;
+        }
+        any = true;
+        ++p;
+    }
+    if (p < end && *p == '.') {
+        ++p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (ndigits < 18) {
+                mant = mant * 10 + (*p - '0');
+                ndigits += mant != 0;
+                exp10--;
+            }
+            any = true;
+            ++p;
+        }
+    }
+    if (!any) {
+        return nullptr;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            eneg = *p == '-';
+            ++p;
+        }
+        uint32_t e;
+        p = scanuint(p, end, &e);
+        if (!p) {
+            return nullptr;
+        }
+        exp10 += eneg ? -(int)e : (int)e;
+    }
+    double v = (double)mant;
+    if (exp10 < 0) {
+        v = -exp10 <= 22 ? v / pow10[-exp10] : v * pow(10.0, exp10);
+    }
+    else if (exp10 > 0) {
+        v = exp10 <= 22 ? v * pow10[exp10] : v * pow(10.0, exp10);
+    }
+    *out = (float)(neg ? -v : v);
+    return p;
+}
+
+static const char* scanvec(const char* p, const char* end, float* v, int n) {
+    for (int i = 0; i < n && p; ++i) {
+        p = scanfloat(p, end, &v[i]);
+    }
+    return p;
+}
+
+// path of a file referenced from a file in basepath. absolute paths
+// ("/x", "\\x" or "C:x") are taken as they are.
+static std::string sourcepath(const std::string& basepath, const std::string& name) {
+    bool absolute = (!name.empty() && (name[0] == '/' || name[0] == '\\')) ||
+        (name.size() >= 2 && name[1] == ':');
+    return absolute ? name : basepath + name;
+}
+
+// end of the line starting at p
+static inline const char* lineend(const char* p, const char* end) {
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    return eol ? eol : end;
+}
+
+// Files are split into line-aligned chunks that are parsed in parallel.
+// Chunks smaller than this are not worth a thread.
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// commands that affect batches and materials. Chunks record them with
+// their position in the chunk's corner array; they are replayed in file
+// order when the chunks are merged.
+struct objcommand {
+    enum { GROUP, USEMTL, MTLLIB } type;
+    std::string arg;
+    size_t index;
+};
+
+// one triangle corner: 0-based position, texcoord and normal index.
+// texcoord and normal are -1 when the face does not reference them,
+// or SHARED_INDEX when the corner has no slashes at all ("f 1 2 3"):
+// pre-normalized files write those and mean the position index for
+// all attributes, see weld().
+static const int32_t SHARED_INDEX = INT32_MIN;
+
+struct objcorner {
+    int32_t p;
+    int32_t t;
+    int32_t n;
+};
+
+// one line-aligned piece of an obj file and everything parsed from it.
+struct objchunk {
+    const char* begin;
+    const char* end;
+
+    // filled by precount()
+    int nlines;
+    size_t npositions;
+    size_t nnormals;
+    size_t ntexcoords;
+    size_t nfaces;
+
+    std::vector<Vector3f> positions;
+    std::vector<Vector3f> normals;
+    std::vector<Vector2f> texcoords;
+    std::vector<objcorner> corners; // triangulated faces
+    std::vector<objcommand> commands;
+
+    // set on error; line numbers are relative to the chunk
+    std::string error;
+    int errorline;
+};
+
+// quick pass over a chunk that counts lines, vertex attributes and
+// faces. The attribute counts of earlier chunks resolve negative
+// indices, and all counts size the output arrays.
+static void precount(objchunk* chunk) {
+    chunk->nlines = 0;
+    chunk->npositions = chunk->nnormals = chunk->ntexcoords = chunk->nfaces = 0;
+    const char* p = chunk->begin;
+    const char* end = chunk->end;
+    while (p < end) {
+        const char* eol = lineend(p, end);
+        chunk->nlines++;
+        p = skipblank(p, eol);
+        if (eol - p >= 2) {
+            if (p[0] == 'v') {
+                if (isblank_(p[1])) {
+                    chunk->npositions++;
+                }
+                else if (p[1] == 'n' && eol - p >= 3 && isblank_(p[2])) {
+                    chunk->nnormals++;
+                }
+                else if (p[1] == 't' && eol - p >= 3 && isblank_(p[2])) {
+                    chunk->ntexcoords++;
+                }
+            }
+            else if (p[0] == 'f' && isblank_(p[1])) {
+                chunk->nfaces++;
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+static const char* scanint(const char* p, const char* end, int32_t* out) {
+    p = skipblank(p, end);
+    bool neg = p < end && *p == '-';
+    if (neg) {
+        ++p;
+    }
+    uint32_t v;
+    p = scanuint(p, end, &v);
+    *out = neg ? -(int32_t)v : (int32_t)v;
+    return p;
+}
+
+// resolves a 1-based or negative (relative) obj index. count is the
+// number of elements defined before the current line.
+static inline int32_t resolveindex(int32_t idx, size_t count) {
+    if (idx > 0) {
+        return idx - 1;
+    }
+    // 0 is invalid in obj; it maps to a negative index and fails later
+    return (int32_t)count + idx;
+}
+
+// reads one face corner: "v", "v/vt", "v//vn" or "v/vt/vn"
+static const char* scancorner(const char* p, const char* end,
+    const size_t counts[3], objcorner* c) {
+    int32_t idx[3] = { 0, 0, 0 };
+    p = scanint(p, end, &idx[0]);
+    bool plain = !p || p >= end || *p != '/';
+    for (int k = 1; k < 3 && p && p < end && *p == '/'; ++k) {
+        ++p;
+        if (p < end && *p != '/' && !isblank_(*p)) {
+            p = scanint(p, end, &idx[k]);
+        }
+    }
+    if (!p || (p < end && !isblank_(*p))) {
+        return nullptr;
+    }
+    c->p = resolveindex(idx[0], counts[0]);
+    if (plain) {
+        c->t = c->n = SHARED_INDEX;
+        return p;
+    }
+    c->t = idx[1] ? resolveindex(idx[1], counts[1]) : -1;
+    c->n = idx[2] ? resolveindex(idx[2], counts[2]) : -1;
+    return p;
+}
+
+// parses a chunk. base holds the number of positions, texcoords and
+// normals defined in all earlier chunks.
+static void parsechunk(objchunk* chunk, const size_t base[3]) {
+    chunk->positions.reserve(chunk->npositions);
+    chunk->normals.reserve(chunk->nnormals);
+    chunk->texcoords.reserve(chunk->ntexcoords);
+    chunk->corners.reserve(chunk->nfaces * 3);
+
+    const char* p = chunk->begin;
+    const char* end = chunk->end;
+    int lineno = 0;
+    while (p < end) {
+        const char* eol = lineend(p, end);
+        const char* line = p;
+        p = eol + 1;
+        lineno++;
+
+        const char* command;
+        size_t len;
+        const char* q = scantoken(line, eol, &command, &len);
+        if (len == 0 || command[0] == '#') {
+            continue;
+        }
+        else if (tokeneq(command, len, "v")) {
+            Vector3f v;
+            q = scanvec(q, eol, &v[0], 3);
+            chunk->positions.push_back(v);
+        }
+        else if (tokeneq(command, len, "vt")) {
+            Vector2f uv;
+            q = scanvec(q, eol, &uv[0], 2);
+            chunk->texcoords.push_back(uv);
+        }
+        else if (tokeneq(command, len, "vn")) {
+            Vector3f n;
+            q = scanvec(q, eol, &n[0], 3);
+            chunk->normals.push_back(n);
+        }
+        else if (tokeneq(command, len, "f")) {
+            // n-gons are triangulated as a fan around the first corner
+            size_t counts[3] = {
+                base[0] + chunk->positions.size(),
+                base[1] + chunk->texcoords.size(),
+                base[2] + chunk->normals.size()
+            };
+            objcorner first, prev, c;
+            int ncorners = 0;
+            while (q && (q = skipblank(q, eol)) < eol) {
+                q = scancorner(q, eol, counts, &c);
+                if (!q) {
+                    break;
+                }
+                if (ncorners == 0) {
+                    first = c;
+                }
+                else if (ncorners >= 2) {
+                    chunk->corners.push_back(first);
+                    chunk->corners.push_back(prev);
+                    chunk->corners.push_back(c);
+                }
+                prev = c;
+                ncorners++;
+            }
+            if (q && ncorners < 3) {
+                chunk->error = "Face with less than 3 vertices";
+                chunk->errorline = lineno;
+                return;
+            }
+        }
+        else if (tokeneq(command, len, "g") ||
+                 tokeneq(command, len, "usemtl") ||
+                 tokeneq(command, len, "mtllib")) {
+            objcommand cmd;
+            cmd.type = command[0] == 'g' ? objcommand::GROUP :
+                (command[0] == 'u' ? objcommand::USEMTL : objcommand::MTLLIB);
+            scanstring(q, eol, &cmd.arg);
+            cmd.index = chunk->corners.size();
+            chunk->commands.push_back(cmd);
+        }
+        else if (tokeneq(command, len, "o") || tokeneq(command, len, "s")) {
+            // object names and smoothing groups are ignored
+        }
+        else {
+            chunk->error = "Unknown obj command: " + std::string(command, len);
+            chunk->errorline = lineno;
+            return;
+        }
+        if (!q) {
+            chunk->error = "Cannot parse line";
+            chunk->errorline = lineno;
+            return;
+        }
+    }
+}
+
+// appends the arrays of all chunks to dst, in chunk order.
+template <typename T>
+static void mergearrays(std::vector<T>* dst, std::vector<objchunk>& chunks,
+    std::vector<T> objchunk::* member) {
+    if (chunks.size() == 1) {
+        dst->swap(chunks[0].*member);
+        return;
+    }
+    std::vector<size_t> offsets(chunks.size());
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        offsets[i] = total;
+        total += (chunks[i].*member).size();
+    }
+    dst->resize(total);
+    parallel_for((int)chunks.size(), [&](int i) {
+        std::vector<T>& src = chunks[i].*member;
+        std::copy(src.begin(), src.end(), dst->begin() + offsets[i]);
+        std::vector<T>().swap(src);
+    });
+}
+
+// Turns triangle corners into one indexed vertex stream. Every unique
+// (position, texcoord, normal) combination becomes a single vertex,
+// found through an open-addressing hash table with linear probing.
+// The table is keyed on the position index spread out by a power of
+// two, so corners of nearby positions probe nearby slots; faces mostly
+// reference recently defined vertices, which keeps the lookups in
+// cache. Vertices are numbered in order of first use, so the result
+// only depends on the corner order.
+struct weldslot {
+    objcorner key;
+    uint32_t vertex;
+};
+
+static void weldinsert(std::vector<weldslot>* table, int shift, const objcorner& c, uint32_t vertex) {
+    size_t mask = table->size() - 1;
+    size_t slot = ((size_t)c.p << shift) & mask;
+    while ((*table)[slot].key.p >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    (*table)[slot].key = c;
+    (*table)[slot].vertex = vertex;
+}
+
+static bool weld(const std::vector<objcorner>& corners,
+    const std::vector<Vector3f>& inpositions,
+    const std::vector<Vector2f>& intexcoords,
+    const std::vector<Vector3f>& innormals,
+    std::vector<Vector3f>* positions,
+    std::vector<Vector2f>* texcoords,
+    std::vector<Vector3f>* normals,
+    std::vector<uint32_t>* indices) {
+    // pre-normalized files reference all attributes with the position
+    // index ("f 1 2 3" with as many vt and vn lines as v lines). only
+    // corners without slashes do; "f 1//1" has no texcoord.
+    bool shared_t = intexcoords.size() == inpositions.size();
+    bool shared_n = innormals.size() == inpositions.size();
+
+    // two slots per position to start with
+    int shift = 1;
+    while (((size_t)1 << shift) < inpositions.size() * 2) {
+        shift++;
+    }
+    size_t capacity = (size_t)1 << shift;
+    shift = 1;
+    weldslot empty;
+    empty.key.p = -1;
+    std::vector<weldslot> table(capacity, empty);
+    std::vector<objcorner> unique;
+    unique.reserve(inpositions.size());
+    indices->resize(corners.size());
+
+    for (size_t i = 0; i < corners.size(); ++i) {
+        objcorner c = corners[i];
+        if (c.t == SHARED_INDEX) {
+            c.t = shared_t ? c.p : -1;
+        }
+        if (c.n == SHARED_INDEX) {
+            c.n = shared_n ? c.p : -1;
+        }
+        if (c.p < 0 || c.p >= (int32_t)inpositions.size() ||
+            c.t >= (int32_t)intexcoords.size() || c.t < -1 ||
+            c.n >= (int32_t)innormals.size() || c.n < -1) {
+            printf("Face index out of range\n");
+            return false;
+        }
+        size_t mask = table.size() - 1;
+        size_t slot = ((size_t)c.p << shift) & mask;
+        uint32_t vertex;
+        while (true) {
+            const weldslot& entry = table[slot];
+            if (entry.key.p < 0) {
+                vertex = (uint32_t)unique.size();
+                table[slot].key = c;
+                table[slot].vertex = vertex;
+                unique.push_back(c);
+                break;
+            }
+            if (entry.key.p == c.p && entry.key.t == c.t && entry.key.n == c.n) {
+                vertex = entry.vertex;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        (*indices)[i] = vertex;
+
+        // keep the load factor below 1/2
+        if (unique.size() * 2 > table.size()) {
+            table.assign(table.size() * 2, empty);
+            shift++;
+            for (uint32_t v = 0; v < unique.size(); ++v) {
+                weldinsert(&table, shift, unique[v], v);
+            }
+        }
+    }
+    std::vector<weldslot>().swap(table);
+
+    // faces without normals get smooth, area-weighted vertex normals
+    std::vector<Vector3f> smooth;
+    for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+        const objcorner& a = unique[(*indices)[i]];
+        const objcorner& b = unique[(*indices)[i + 1]];
+        const objcorner& c = unique[(*indices)[i + 2]];
+        if (a.n >= 0 && b.n >= 0 && c.n >= 0) {
+            continue;
+        }
+        if (smooth.empty()) {
+            smooth.resize(inpositions.size());
+        }
+        Vector3f pa = inpositions[a.p];
+        Vector3f facenormal = Vector3f::cross(inpositions[b.p] - pa, inpositions[c.p] - pa);
+        smooth[a.p] += facenormal;
+        smooth[b.p] += facenormal;
+        smooth[c.p] += facenormal;
+    }
+
+    positions->resize(unique.size());
+    texcoords->resize(unique.size());
+    normals->resize(unique.size());
+    for (size_t v = 0; v < unique.size(); ++v) {
+        const objcorner& u = unique[v];
+        (*positions)[v] = inpositions[u.p];
+        (*texcoords)[v] = u.t >= 0 ? intexcoords[u.t] : Vector2f(0, 0);
+        if (u.n >= 0) {
+            (*normals)[v] = innormals[u.n];
+        }
+        else {
+            Vector3f n = smooth[u.p];
+            (*normals)[v] = n.absSquared() > 0 ? n.normalized() : Vector3f(0, 1, 0);
+        }
+    }
+    return true;
 }
 
 bool objparser::parse(const std::string& objfile) {
     clear();
 
-    std::fstream fh(objfile);
-    if (!fh) {
+    std::string cachefile = scenecachefile(objfile);
+    if (loadscenecache(cachefile, this)) {
+        printf("Loaded scene from cache %s\n", cachefile.c_str());
+        return true;
+    }
+    if (!parseobj(objfile)) {
+        return false;
+    }
+    if (!writescenecache(cachefile, *this)) {
+        printf("Cannot write scene cache %s\n", cachefile.c_str());
+    }
+    return true;
+}
+
+bool objparser::parseobj(const std::string& objfile) {
+    clear();
+
+    mappedfile fh;
+    if (!fh.open(objfile)) {
         printf("Cannot open file %s\n", objfile.c_str());
         return false;
     }
+    sourcefiles.push_back(objfile);
 
     size_t last_sep = objfile.find_last_of("\\/");
     std::string basepath;
@@ -35,74 +579,126 @@ bool objparser::parse(const std::string& objfile) {
         basepath = objfile.substr(0, last_sep + 1);
     }
 
-    std::map<std::string, material> materials;
+    // split the file into line-aligned chunks
+    const char* data = fh.data();
+    const char* end = data + fh.size();
+    size_t nchunks = fh.size() / MIN_CHUNK_BYTES;
+    // a few chunks per worker keep the load balanced. on a single
+    // core, one chunk avoids the merge copy.
+    size_t maxchunks = workercount() > 1 ? (size_t)workercount() * 4 : 1;
+    nchunks = std::max((size_t)1, std::min(nchunks, maxchunks));
+    std::vector<objchunk> chunks(nchunks);
+    const char* p = data;
+    for (size_t i = 0; i < nchunks; ++i) {
+        const char* chunkend = data + fh.size() * (i + 1) / nchunks;
+        if (chunkend < p) {
+            chunkend = p;
+        }
+        if (chunkend < end) {
+            chunkend = lineend(chunkend, end);
+            chunkend = chunkend < end ? chunkend + 1 : end;
+        }
+        chunks[i].begin = p;
+        chunks[i].end = chunkend;
+        p = chunkend;
+    }
 
-    draw_batch current_batch;
+    // count first, so every chunk knows how many vertex attributes
+    // precede it; negative face indices are relative to those.
+    parallel_for((int)nchunks, [&](int i) {
+        precount(&chunks[i]);
+    });
+    std::vector<size_t> bases(nchunks * 3);
+    size_t counts[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < nchunks; ++i) {
+        bases[i * 3 + 0] = counts[0];
+        bases[i * 3 + 1] = counts[1];
+        bases[i * 3 + 2] = counts[2];
+        counts[0] += chunks[i].npositions;
+        counts[1] += chunks[i].ntexcoords;
+        counts[2] += chunks[i].nnormals;
+    }
+    parallel_for((int)nchunks, [&](int i) {
+        parsechunk(&chunks[i], &bases[i * 3]);
+    });
 
-    std::string line;
-    while (std::getline(fh, line)) {
-        std::stringstream ibuff(line);
-        std::string command;
-        ibuff >> command;
-        if (command == "#" || command == "") {
-            continue;
-        }
-        else if (command == "v") {
-            Vector3f p;
-            ibuff >> p.x() >> p.y() >> p.z();
-            positions.push_back(p);
+    int firstline = 0;
+    for (size_t i = 0; i < nchunks; ++i) {
+        if (!chunks[i].error.empty()) {
+            printf("%s at line %d of %s\n", chunks[i].error.c_str(),
+                firstline + chunks[i].errorline, objfile.c_str());
+            return false;
         }
-        else if (command == "vt") {
-            Vector2f uv;
-            ibuff >> uv.x() >> uv.y();
-            texcoords.push_back(uv);
+        firstline += chunks[i].nlines;
+    }
+
+    // replay batch and material commands in file order.
+    // positions recorded by the chunks are rebased to the merged array.
+    std::map<std::string, material> mtlmaterials;
+    std::map<std::string, int> materialids;
+    // adds a material to the table on first use
+    auto materialid = [&](const std::string& name) {
+        auto it = materialids.find(name);
+        if (it != materialids.end()) {
+            return it->second;
         }
-        else if (command == "vn") {
-            Vector3f n;
-            ibuff >> n.x() >> n.y() >> n.z();
-            normals.push_back(n);
-        }
-        else if (command == "f") {
-            uint32_t a, b, c;
-            ibuff >> a >> b >> c;
-            indices.push_back(a - 1);
-            indices.push_back(b - 1);
-            indices.push_back(c - 1);
-        }
-        else if (command == "g") {
-            if (current_batch.name != "") {
-                // end previous batch
-                current_batch.nindices = (int)indices.size() - current_batch.start_index;
-                batches.push_back(current_batch);
+        int id = (int)materials.size();
+        materials.push_back(mtlmaterials[name]);
+        materialids.insert(std::make_pair(name, id));
+        return id;
+    };
+
+    draw_batch current_batch;
+    current_batch.material_id = -1;
+
+    size_t indexbase = 0;
+    for (size_t i = 0; i < nchunks; ++i) {
+        for (const objcommand& cmd : chunks[i].commands) {
+            int index = (int)(indexbase + cmd.index);
+            if (cmd.type == objcommand::GROUP) {
+                if (current_batch.name != "") {
+                    // end previous batch
+                    current_batch.nindices = index - current_batch.start_index;
+                    batches.push_back(current_batch);
+                }
+                // start new batch
+                current_batch.start_index = index;
+                current_batch.name = cmd.arg;
+                printf("New geometry %s at face index %d\n", current_batch.name.c_str(), index);
             }
-            // start new batch
-            current_batch.start_index = (int)indices.size();
-            ibuff >> current_batch.name;
-            printf("New geometry %s at face index %d\n", current_batch.name.c_str(), (int)indices.size());
-        }
-        else if (command == "usemtl") {
-            std::string usemtl;
-            ibuff >> usemtl;
-            printf("Use material %s at face index %d\n", usemtl.c_str(), (int)indices.size());
-            current_batch.mat = materials[usemtl];
-        }
-        else if (command == "mtllib") {
-            std::string mtllib;
-            ibuff >> mtllib;
-            printf("Use material library %s%s\n", basepath.c_str(), mtllib.c_str());
-            if (!parsemtl(basepath + mtllib, &materials)) {
-                clear();
-                return false;
+            else if (cmd.type == objcommand::USEMTL) {
+                printf("Use material %s at face index %d\n", cmd.arg.c_str(), index);
+                current_batch.material_id = materialid(cmd.arg);
             }
-            if (!loadtextures(basepath, materials)) {
-                clear();
-                return false;
+            else {
+                std::string mtlfile = sourcepath(basepath, cmd.arg);
+                printf("Use material library %s\n", mtlfile.c_str());
+                if (!parsemtl(mtlfile, &mtlmaterials)) {
+                    clear();
+                    return false;
+                }
+                if (!loadtextures(basepath, mtlmaterials)) {
+                    clear();
+                    return false;
+                }
             }
         }
-        else {
-            printf("Unknown obj command: %s\n", command.c_str());
-            return false;
-        }
+        indexbase += chunks[i].corners.size();
+    }
+
+    std::vector<Vector3f> filepositions;
+    std::vector<Vector3f> filenormals;
+    std::vector<Vector2f> filetexcoords;
+    std::vector<objcorner> corners;
+    mergearrays(&filepositions, chunks, &objchunk::positions);
+    mergearrays(&filenormals, chunks, &objchunk::normals);
+    mergearrays(&filetexcoords, chunks, &objchunk::texcoords);
+    mergearrays(&corners, chunks, &objchunk::corners);
+
+    if (!weld(corners, filepositions, filetexcoords, filenormals,
+              &positions, &texcoords, &normals, &indices)) {
+        clear();
+        return false;
     }
 
     if (current_batch.name != "") {
@@ -110,56 +706,102 @@ bool objparser::parse(const std::string& objfile) {
         current_batch.nindices = (int)indices.size() - current_batch.start_index;
         batches.push_back(current_batch);
     }
-
-    assert(positions.size() == normals.size());   // THIS IS NOT TRUE IN GENERAL FOR OBJ
-    assert(positions.size() == texcoords.size()); // WE ASSUME A NORMALIZED FILE FORMAT
+    // batches without usemtl share a default material
+    for (draw_batch& batch : batches) {
+        if (batch.material_id < 0) {
+            batch.material_id = materialid("");
+        }
+    }
+    sortbatches();
     return true;
 }
+
+void objparser::sortbatches() {
+    // materials that share a texture end up next to each other
+    std::vector<draw_batch> sorted(batches);
+    std::stable_sort(sorted.begin(), sorted.end(), [&](const draw_batch& a, const draw_batch& b) {
+        const std::string& ta = materials[a.material_id].diffuse_texture;
+        const std::string& tb = materials[b.material_id].diffuse_texture;
+        if (ta != tb) {
+            return ta < tb;
+        }
+        return a.material_id < b.material_id;
+    });
+
+    std::vector<uint32_t> sortedindices;
+    sortedindices.reserve(indices.size());
+    batches.clear();
+    for (const draw_batch& batch : sorted) {
+        if (batch.nindices == 0) {
+            continue;
+        }
+        if (!batches.empty() && batches.back().material_id == batch.material_id) {
+            batches.back().nindices += batch.nindices;
+        }
+        else {
+            draw_batch merged = batch;
+            merged.start_index = (int)sortedindices.size();
+            batches.push_back(merged);
+        }
+        sortedindices.insert(sortedindices.end(),
+            indices.begin() + batch.start_index,
+            indices.begin() + batch.start_index + batch.nindices);
+    }
+    indices.swap(sortedindices);
+    printf("Merged %d batches into %d material batches\n", (int)sorted.size(), (int)batches.size());
+}
+
 bool objparser::parsemtl(const std::string& mtlfile, std::map<std::string, material> * materials) {
-    std::fstream fh(mtlfile);
-    if (!fh) {
+    mappedfile fh;
+    if (!fh.open(mtlfile)) {
         printf("Cannot open mtl file %s\n", mtlfile.c_str());
         return false;
     }
+    sourcefiles.push_back(mtlfile);
 
     std::string matname;
     material mat;
 
-    std::string line;
-    while (std::getline(fh, line)) {
-        std::stringstream ibuff(line);
-        std::string command;
-        ibuff >> command;
-        if (command == "#" || command == "") {
+    const char* p = fh.data();
+    const char* end = p + fh.size();
+    while (p < end) {
+        const char* eol = lineend(p, end);
+        const char* line = p;
+        p = eol + 1;
+
+        const char* command;
+        size_t len;
+        const char* q = scantoken(line, eol, &command, &len);
+        if (len == 0 || command[0] == '#') {
             continue;
         }
-        else if (command == "newmtl") {
+        else if (tokeneq(command, len, "newmtl")) {
             if (matname != "") {
                 materials->insert(std::make_pair(matname, mat));
                 mat = material();
             }
-            ibuff >> matname;
+            scanstring(q, eol, &matname);
         }
-        else if (command == "Ns") {
-            ibuff >> mat.shininess;
+        else if (tokeneq(command, len, "Ns")) {
+            scanfloat(q, eol, &mat.shininess);
         }
-        else if (command == "Ka") {
-            ibuff >> mat.ambient.x() >> mat.ambient.y() >> mat.ambient.z();
+        else if (tokeneq(command, len, "Ka")) {
+            scanvec(q, eol, &mat.ambient[0], 3);
         }
-        else if (command == "Kd") {
-            ibuff >> mat.diffuse.x() >> mat.diffuse.y() >> mat.diffuse.z();
+        else if (tokeneq(command, len, "Kd")) {
+            scanvec(q, eol, &mat.diffuse[0], 3);
         }
-        else if (command == "Ks") {
-            ibuff >> mat.specular.x() >> mat.specular.y() >> mat.specular.z();
+        else if (tokeneq(command, len, "Ks")) {
+            scanvec(q, eol, &mat.specular[0], 3);
         }
-        else if (command == "map_Kd") {
-            ibuff >> mat.diffuse_texture;
+        else if (tokeneq(command, len, "map_Kd")) {
+            scanstring(q, eol, &mat.diffuse_texture);
         }
-        else if (command == "map_bump") {
+        else if (tokeneq(command, len, "map_bump")) {
             // ignoring bump map
         }
         else {
-            printf("Unknown MTL command %s\n", command.c_str());
+            printf("Unknown MTL command %s\n", std::string(command, len).c_str());
         }
     }
     if (matname != "") {
@@ -168,27 +810,47 @@ bool objparser::parsemtl(const std::string& mtlfile, std::map<std::string, mater
     return true;
 }
 bool objparser::loadtextures(const std::string& basepath, const std::map<std::string, material>& materials) {
+    // each texture is decoded once, even if several materials use it
+    std::vector<std::string> names;
     for (auto it = materials.begin(); it != materials.end(); ++it) {
-        material mat = it->second;
-        if (mat.diffuse_texture != "") {
-            std::string jpgfile = basepath + mat.diffuse_texture;
-            printf("Loading texture from %s\n", jpgfile.c_str());
-
-            rgbimage im;
-            int nc;
-            uint8_t* imdata = stbi_load(jpgfile.c_str(), &im.w, &im.h, &nc, 3);
-            if (!imdata || nc != 3) {
-               printf("Loading texture from %s failed\n", jpgfile.c_str());
-               return false;
-            }
-            im.data.resize(im.w * im.h * nc);
-            std::copy(imdata, imdata + im.data.size(), im.data.begin());
-            // note: this code id not the most efficient.
-            // we first std::copy from the stbi pointer into the rgbimage on the stack.
-            // Then, we copy the rgbimage into the map, which can copy the array again.
-            textures.insert(std::make_pair(mat.diffuse_texture, im));
-            //printf("Load Image w=%d h=%d nc = %d\n", w, h, nc); stbi_image_free(imdata);
+        const std::string& name = it->second.diffuse_texture;
+        if (name != "" && textures.find(name) == textures.end() &&
+            std::find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+        }
+    }
+
+    // decode on the worker pool
+    // images that fail to load are left without pixels. this relies on
+    // stb_image keeping no shared mutable state: its zlib tables are
+    // static and stbi_failure_reason() is per thread, so it would have
+    // to be read on the worker that failed.
+    std::vector<rgbimage> images(names.size());
+    parallel_for((int)names.size(), [&](int i) {
+        std::string jpgfile = sourcepath(basepath, names[i]);
+        rgbimage& im = images[i];
+        int nc;
+        uint8_t* imdata = stbi_load(jpgfile.c_str(), &im.w, &im.h, &nc, 3);
+        if (!imdata || nc != 3) {
+            stbi_image_free(imdata);
+            return;
+        }
+        // the image takes ownership of the decoded pixels
+        im.pixels = std::shared_ptr<const uint8_t>(imdata, [](const uint8_t* p) {
+            stbi_image_free((void*)p);
+        });
+    });
+
+    // insert in material order, so the result does not depend on timing
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::string jpgfile = sourcepath(basepath, names[i]);
+        printf("Loading texture from %s\n", jpgfile.c_str());
+        if (!images[i].pixels) {
+            printf("Loading texture from %s failed\n", jpgfile.c_str());
+            return false;
         }
+        textures.insert(std::make_pair(names[i], std::move(images[i])));
+        sourcefiles.push_back(jpgfile);
     }
     return true;
 }
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <cstdint>
 
 #include <vecmath.h>
 
@@ -15,12 +17,14 @@ struct material {
     std::string diffuse_texture;
 };
 
-// data is an array of RGB pixels.
+// pixels is an array of RGB pixels.
 // there is no alpha channel.
+// the pixel memory is shared: it is owned either by the image decoder
+// or by a mapped scene cache file, and is never copied.
 struct rgbimage {
     int w;
     int h;
-    std::vector<uint8_t> data;
+    std::shared_ptr<const uint8_t> pixels;
 };
 
 // a single obj file can contain multiple pieces of geometry.
@@ -31,26 +35,40 @@ struct draw_batch {
     std::string name; // useful for debugging
     int start_index;
     int nindices;
-    material mat;
+    int material_id; // index into objparser::materials
 };
 
 class objparser {
 public:
-    // return false on error
+    // return false on error.
+    // loads the scene from the .smesh cache next to objfile if it is
+    // up to date, otherwise parses objfile and writes the cache.
     bool parse(const std::string& objfile);
     void clear();
 
     // the parse() method fills these arrays with vertex, 
-    // index, and texture data
+    // index, and texture data.
+    // positions, normals and texcoords share one index: every unique
+    // v/vt/vn combination referenced by a face is one vertex.
+    // faces are triangulated; missing normals are computed.
     std::vector<Vector3f>           positions;
     std::vector<Vector3f>           normals;
     std::vector<Vector2f>           texcoords;
 
     std::vector<uint32_t>           indices;
+    // batches are sorted by material, and batches that share a
+    // material are merged, so every material is drawn at most once.
     std::vector<draw_batch>         batches;
+    std::vector<material>           materials;
     std::map<std::string, rgbimage> textures;
 
+    // obj, mtl and texture files the scene was loaded from
+    std::vector<std::string>        sourcefiles;
+
 private:
+    // parse the obj text file and the files it references
+    bool parseobj(const std::string& objfile);
+
     // parse materials from .mtl file and store in materials map.
     bool parsemtl(const std::string& mtlfile, 
                   std::map<std::string, material> * materials);
@@ -58,6 +76,10 @@ private:
     // parse textures referenced by mtl file.
     bool loadtextures(const std::string& basepath, 
                       const std::map<std::string, material>& materials);
+
+    // sort batches by texture and material, and merge batches that
+    // use the same material. reorders the index array to match.
+    void sortbatches();
 };
 
 #endif
\ No newline at end of file
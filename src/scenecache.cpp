@@ -0,0 +1,421 @@
+#include "scenecache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/stat.h>
+
+#include "objparser.h"
+#include "mappedfile.h"
+
+static const char SMESH_MAGIC[4] = { 'S', 'M', 'S', 'H' };
+// bump whenever the file layout, or what the parser makes of the same
+// sources, changes
+static const uint32_t SMESH_VERSION = 4;
+// every section starts at a multiple of this
+static const uint64_t SMESH_ALIGN = 64;
+
+enum {
+    SECTION_SOURCES,    // source files, whether relative, and their stamps
+    SECTION_POSITIONS,  // Vector3f array
+    SECTION_NORMALS,    // Vector3f array
+    SECTION_TEXCOORDS,  // Vector2f array
+    SECTION_INDICES,    // uint32_t array
+    SECTION_BATCHES,    // draw_batch records
+    SECTION_MATERIALS,  // material table
+    SECTION_PIXELS,     // texture pixels, each image aligned
+    SECTION_TEXTURES,   // texture table pointing into SECTION_PIXELS
+    SECTION_COUNT
+};
+
+struct smeshheader {
+    char magic[4];
+    uint32_t version;
+    uint64_t offset[SECTION_COUNT];
+    uint64_t size[SECTION_COUNT];
+};
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "Vector3f must be tightly packed");
+static_assert(sizeof(Vector2f) == 2 * sizeof(float), "Vector2f must be tightly packed");
+
+// size, modification time and content hash of a source file
+struct sourcestamp {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
+static bool statfile(const std::string& fname, sourcestamp* stamp) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) {
+        return false;
+    }
+    stamp->size = (uint64_t)st.st_size;
+    stamp->mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+// 64 bit FNV-1a hash of the file contents
+static bool hashfile(const std::string& fname, uint64_t* hash) {
+    mappedfile fh;
+    if (!fh.open(fname)) {
+        return false;
+    }
+    uint64_t h = 14695981039346656037ull;
+    const uint8_t* p = (const uint8_t*)fh.data();
+    for (size_t i = 0; i < fh.size(); ++i) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    *hash = h;
+    return true;
+}
+
+static std::string dirname(const std::string& fname) {
+    size_t last_sep = fname.find_last_of("\\/");
+    return last_sep == std::string::npos ? "" : fname.substr(0, last_sep + 1);
+}
+
+// sequential writer that tracks the file position
+class cachewriter {
+public:
+    cachewriter(FILE* fh, smeshheader* header) :
+        m_fh(fh), m_header(header), m_pos(0), m_ok(true) {}
+
+    void write(const void* data, size_t n) {
+        if (n && fwrite(data, 1, n, m_fh) != n) {
+            m_ok = false;
+        }
+        m_pos += n;
+    }
+    template <typename T>
+    void put(const T& v) {
+        write(&v, sizeof(v));
+    }
+    void putstring(const std::string& s) {
+        put((uint32_t)s.size());
+        write(s.data(), s.size());
+    }
+    void putvec(const Vector3f& v) {
+        write(&v[0], 3 * sizeof(float));
+    }
+    void align() {
+        static const char zeros[SMESH_ALIGN] = {};
+        write(zeros, (size_t)((SMESH_ALIGN - m_pos % SMESH_ALIGN) % SMESH_ALIGN));
+    }
+    void begin(int section) {
+        align();
+        m_header->offset[section] = m_pos;
+    }
+    void end(int section) {
+        m_header->size[section] = m_pos - m_header->offset[section];
+    }
+    uint64_t pos() const { return m_pos; }
+    bool ok() const { return m_ok; }
+
+private:
+    FILE* m_fh;
+    smeshheader* m_header;
+    uint64_t m_pos;
+    bool m_ok;
+};
+
+// bounds-checked reader over one mapped section
+class cachereader {
+public:
+    cachereader(const char* data, size_t size) :
+        m_p(data), m_end(data + size), m_ok(true) {}
+
+    const char* read(size_t n) {
+        if ((size_t)(m_end - m_p) < n) {
+            m_ok = false;
+            return nullptr;
+        }
+        const char* p = m_p;
+        m_p += n;
+        return p;
+    }
+    template <typename T>
+    T get() {
+        T v = T();
+        const char* p = read(sizeof(T));
+        if (p) {
+            memcpy(&v, p, sizeof(T));
+        }
+        return v;
+    }
+    std::string getstring() {
+        uint32_t n = get<uint32_t>();
+        const char* p = read(n);
+        return p ? std::string(p, n) : std::string();
+    }
+    Vector3f getvec() {
+        Vector3f v;
+        const char* p = read(3 * sizeof(float));
+        if (p) {
+            memcpy(&v[0], p, 3 * sizeof(float));
+        }
+        return v;
+    }
+    const char* pos() const { return m_p; }
+    bool ok() const { return m_ok; }
+
+private:
+    const char* m_p;
+    const char* m_end;
+    bool m_ok;
+};
+
+template <typename T>
+static void putarray(cachewriter* w, int section, const std::vector<T>& v) {
+    w->begin(section);
+    w->write(v.data(), v.size() * sizeof(T));
+    w->end(section);
+}
+
+template <typename T>
+static bool getarray(const mappedfile& fh, const smeshheader& header, int section, std::vector<T>* v) {
+    if (header.size[section] % sizeof(T) != 0) {
+        return false;
+    }
+    const T* begin = (const T*)(fh.data() + header.offset[section]);
+    v->assign(begin, begin + header.size[section] / sizeof(T));
+    return true;
+}
+
+std::string scenecachefile(const std::string& objfile) {
+    size_t dot = objfile.find_last_of('.');
+    if (dot == std::string::npos || dot < dirname(objfile).size()) {
+        return objfile + ".smesh";
+    }
+    return objfile.substr(0, dot) + ".smesh";
+}
+
+bool loadscenecache(const std::string& cachefile, objparser* scene) {
+    std::shared_ptr<mappedfile> fh = std::make_shared<mappedfile>();
+    if (!fh->open(cachefile)) {
+        return false;
+    }
+    smeshheader header;
+    if (fh->size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, fh->data(), sizeof(header));
+    if (memcmp(header.magic, SMESH_MAGIC, sizeof(SMESH_MAGIC)) != 0 ||
+        header.version != SMESH_VERSION) {
+        printf("Ignoring scene cache %s: unsupported format\n", cachefile.c_str());
+        return false;
+    }
+    for (int i = 0; i < SECTION_COUNT; ++i) {
+        if (header.offset[i] > fh->size() || header.size[i] > fh->size() - header.offset[i]) {
+            printf("Ignoring scene cache %s: truncated file\n", cachefile.c_str());
+            return false;
+        }
+    }
+    auto section = [&](int i) {
+        return cachereader(fh->data() + header.offset[i], (size_t)header.size[i]);
+    };
+
+    // the cache is stale as soon as a source file changed. files with a
+    // new modification time but identical contents do not count.
+    std::string basepath = dirname(cachefile);
+    std::vector<std::string> sources;
+    std::vector<std::pair<uint64_t, sourcestamp>> touched;
+    cachereader rd = section(SECTION_SOURCES);
+    uint32_t nsources = rd.get<uint32_t>();
+    for (uint32_t i = 0; i < nsources && rd.ok(); ++i) {
+        bool relative = rd.get<uint8_t>() != 0;
+        std::string fname = rd.getstring();
+        if (relative) {
+            fname = basepath + fname;
+        }
+        uint64_t stampoffset = (uint64_t)(rd.pos() - fh->data());
+        sourcestamp stamp = rd.get<sourcestamp>();
+        sourcestamp current;
+        if (!statfile(fname, &current) || current.size != stamp.size ||
+            (current.mtime != stamp.mtime &&
+             (!hashfile(fname, &current.hash) || current.hash != stamp.hash))) {
+            printf("Scene cache %s is out of date\n", cachefile.c_str());
+            return false;
+        }
+        if (current.mtime != stamp.mtime) {
+            touched.push_back(std::make_pair(stampoffset, current));
+        }
+        sources.push_back(fname);
+    }
+
+    scene->clear();
+    bool ok = rd.ok() &&
+        getarray(*fh, header, SECTION_POSITIONS, &scene->positions) &&
+        getarray(*fh, header, SECTION_NORMALS, &scene->normals) &&
+        getarray(*fh, header, SECTION_TEXCOORDS, &scene->texcoords) &&
+        getarray(*fh, header, SECTION_INDICES, &scene->indices);
+
+    rd = section(SECTION_BATCHES);
+    uint32_t nbatches = rd.get<uint32_t>();
+    for (uint32_t i = 0; i < nbatches && ok && rd.ok(); ++i) {
+        draw_batch batch;
+        batch.name = rd.getstring();
+        batch.start_index = rd.get<int32_t>();
+        batch.nindices = rd.get<int32_t>();
+        batch.material_id = rd.get<int32_t>();
+        scene->batches.push_back(batch);
+    }
+    ok = ok && rd.ok();
+
+    rd = section(SECTION_MATERIALS);
+    uint32_t nmaterials = rd.get<uint32_t>();
+    for (uint32_t i = 0; i < nmaterials && ok && rd.ok(); ++i) {
+        material mat;
+        mat.shininess = rd.get<float>();
+        mat.ambient = rd.getvec();
+        mat.diffuse = rd.getvec();
+        mat.specular = rd.getvec();
+        mat.diffuse_texture = rd.getstring();
+        scene->materials.push_back(mat);
+    }
+    ok = ok && rd.ok();
+    for (const draw_batch& batch : scene->batches) {
+        ok = ok && batch.material_id >= 0 && batch.material_id < (int)nmaterials;
+    }
+
+    // texture pixels stay in the mapping; every image holds a reference
+    // to it, so it is unmapped once the last texture is released.
+    const char* pixels = fh->data() + header.offset[SECTION_PIXELS];
+    rd = section(SECTION_TEXTURES);
+    uint32_t ntextures = rd.get<uint32_t>();
+    for (uint32_t i = 0; i < ntextures && ok && rd.ok(); ++i) {
+        std::string name = rd.getstring();
+        rgbimage im;
+        im.w = rd.get<int32_t>();
+        im.h = rd.get<int32_t>();
+        uint64_t offset = rd.get<uint64_t>();
+        uint64_t nbytes = (uint64_t)im.w * im.h * 3;
+        if (offset > header.size[SECTION_PIXELS] ||
+            nbytes > header.size[SECTION_PIXELS] - offset) {
+            ok = false;
+            break;
+        }
+        im.pixels = std::shared_ptr<const uint8_t>(fh, (const uint8_t*)pixels + offset);
+        scene->textures.insert(std::make_pair(name, im));
+    }
+    ok = ok && rd.ok();
+
+    if (!ok) {
+        printf("Ignoring scene cache %s: malformed file\n", cachefile.c_str());
+        scene->clear();
+        return false;
+    }
+    scene->sourcefiles = sources;
+
+    // store the new modification times of touched files so they are
+    // not hashed again next time. only an optimization; where the
+    // mapping keeps the file from being opened for writing the stamps
+    // simply stay as they are.
+    if (!touched.empty()) {
+        FILE* wfh = fopen(cachefile.c_str(), "r+b");
+        if (wfh) {
+            for (const auto& t : touched) {
+                if (fseek(wfh, (long)t.first, SEEK_SET) != 0 ||
+                    fwrite(&t.second, sizeof(sourcestamp), 1, wfh) != 1) {
+                    break;
+                }
+            }
+            fclose(wfh);
+        }
+    }
+    return true;
+}
+
+bool writescenecache(const std::string& cachefile, const objparser& scene) {
+    std::string tmpfile = cachefile + ".tmp";
+    FILE* fh = fopen(tmpfile.c_str(), "wb");
+    if (!fh) {
+        return false;
+    }
+
+    smeshheader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SMESH_MAGIC, sizeof(SMESH_MAGIC));
+    header.version = SMESH_VERSION;
+
+    cachewriter w(fh, &header);
+    // placeholder; the section table is filled in at the end
+    w.put(header);
+
+    // source paths below the directory of the cache file are stored
+    // relative to it, others (e.g. an absolute mtllib) as they are
+    std::string basepath = dirname(cachefile);
+    bool ok = true;
+    w.begin(SECTION_SOURCES);
+    w.put((uint32_t)scene.sourcefiles.size());
+    for (const std::string& fname : scene.sourcefiles) {
+        sourcestamp stamp;
+        if (!statfile(fname, &stamp) || !hashfile(fname, &stamp.hash)) {
+            ok = false;
+            break;
+        }
+        bool relative = fname.compare(0, basepath.size(), basepath) == 0;
+        w.put((uint8_t)relative);
+        w.putstring(relative ? fname.substr(basepath.size()) : fname);
+        w.put(stamp);
+    }
+    w.end(SECTION_SOURCES);
+
+    putarray(&w, SECTION_POSITIONS, scene.positions);
+    putarray(&w, SECTION_NORMALS, scene.normals);
+    putarray(&w, SECTION_TEXCOORDS, scene.texcoords);
+    putarray(&w, SECTION_INDICES, scene.indices);
+
+    w.begin(SECTION_BATCHES);
+    w.put((uint32_t)scene.batches.size());
+    for (const draw_batch& batch : scene.batches) {
+        w.putstring(batch.name);
+        w.put((int32_t)batch.start_index);
+        w.put((int32_t)batch.nindices);
+        w.put((int32_t)batch.material_id);
+    }
+    w.end(SECTION_BATCHES);
+
+    w.begin(SECTION_MATERIALS);
+    w.put((uint32_t)scene.materials.size());
+    for (const material& mat : scene.materials) {
+        w.put(mat.shininess);
+        w.putvec(mat.ambient);
+        w.putvec(mat.diffuse);
+        w.putvec(mat.specular);
+        w.putstring(mat.diffuse_texture);
+    }
+    w.end(SECTION_MATERIALS);
+
+    std::vector<uint64_t> offsets;
+    w.begin(SECTION_PIXELS);
+    for (auto it = scene.textures.begin(); it != scene.textures.end(); ++it) {
+        const rgbimage& im = it->second;
+        w.align();
+        offsets.push_back(w.pos() - header.offset[SECTION_PIXELS]);
+        w.write(im.pixels.get(), (size_t)im.w * im.h * 3);
+    }
+    w.end(SECTION_PIXELS);
+
+    w.begin(SECTION_TEXTURES);
+    w.put((uint32_t)scene.textures.size());
+    size_t i = 0;
+    for (auto it = scene.textures.begin(); it != scene.textures.end(); ++it, ++i) {
+        w.putstring(it->first);
+        w.put((int32_t)it->second.w);
+        w.put((int32_t)it->second.h);
+        w.put(offsets[i]);
+    }
+    w.end(SECTION_TEXTURES);
+
+    ok = ok && w.ok() && fseek(fh, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, fh) == 1;
+    ok = fclose(fh) == 0 && ok;
+    if (!ok) {
+        remove(tmpfile.c_str());
+        return false;
+    }
+    // replace the old cache only once the new one is complete
+    remove(cachefile.c_str());
+    return rename(tmpfile.c_str(), cachefile.c_str()) == 0;
+}
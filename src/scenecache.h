@@ -0,0 +1,31 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <string>
+
+class objparser;
+
+// Binary scene cache (.smesh files).
+//
+// A cache holds everything objparser produces: vertex and index arrays,
+// draw batches, the material table, and decoded texture pixels. Every
+// section starts on an aligned offset, so a memory-mapped cache can be
+// used in place; texture pixels are handed to the renderer straight
+// from the mapping.
+//
+// The cache also lists the source files it was built from, with their
+// size, modification time and content hash. It is considered stale as
+// soon as one of them changes. Cache files are native-endian and meant
+// to stay on the machine that wrote them.
+
+// path of the cache file that belongs to objfile
+std::string scenecachefile(const std::string& objfile);
+
+// return false if the cache is missing, stale or malformed.
+// on success the scene keeps the cache file mapped.
+bool loadscenecache(const std::string& cachefile, objparser* scene);
+
+// return false if the cache could not be written
+bool writescenecache(const std::string& cachefile, const objparser& scene);
+
+#endif
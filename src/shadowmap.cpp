@@ -0,0 +1,1181 @@
+#include "shadowmap.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <utility>
+
+struct shadowformat {
+    GLenum internalformat;
+    GLenum type;
+    int bytes; // per texel
+    const char* name;
+};
+static const shadowformat SHADOW_FORMATS[NUM_SHADOW_FORMATS] = {
+    { GL_DEPTH_COMPONENT16, GL_UNSIGNED_SHORT, 2, "16 bit" },
+    { GL_DEPTH_COMPONENT24, GL_UNSIGNED_INT, 4, "24 bit" },
+    { GL_DEPTH_COMPONENT32F, GL_FLOAT, 4, "32 bit float" },
+};
+
+ShadowMap::ShadowMap() :
+    m_texture(0),
+    m_layeredframebuffer(0),
+    m_comparesampler(0),
+    m_size(0),
+    m_layers(0),
+    m_format(SHADOW_DEPTH24)
+{
+}
+
+ShadowMap::ShadowMap(ShadowMap&& other) :
+    ShadowMap()
+{
+    *this = std::move(other);
+}
+
+ShadowMap& ShadowMap::operator=(ShadowMap&& other)
+{
+    if (this != &other) {
+        free();
+        m_texture = other.m_texture;
+        m_framebuffers = std::move(other.m_framebuffers);
+        m_layeredframebuffer = other.m_layeredframebuffer;
+        m_comparesampler = other.m_comparesampler;
+        m_size = other.m_size;
+        m_layers = other.m_layers;
+        m_format = other.m_format;
+        other.m_texture = 0;
+        other.m_framebuffers.clear();
+        other.m_layeredframebuffer = 0;
+        other.m_comparesampler = 0;
+        other.m_size = 0;
+        other.m_layers = 0;
+    }
+    return *this;
+}
+
+bool ShadowMap::allocate(int size, int nlayers, int format)
+{
+    free();
+    m_size = size;
+    m_layers = nlayers;
+    m_format = format;
+    const shadowformat& f = SHADOW_FORMATS[format];
+
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, f.internalformat, size, size, nlayers, 0,
+        GL_DEPTH_COMPONENT, f.type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenSamplers(1, &m_comparesampler);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(m_comparesampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // one framebuffer per layer, so switching cascades does not
+    // change attachments of a bound framebuffer
+    m_framebuffers.resize(nlayers);
+    glGenFramebuffers(nlayers, m_framebuffers.data());
+    bool complete = true;
+    for (int i = 0; i < nlayers; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_texture, 0, i);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            complete = false;
+        }
+    }
+
+    // attaching the whole array makes the framebuffer layered
+    glGenFramebuffers(1, &m_layeredframebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_layeredframebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        complete = false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+void ShadowMap::free()
+{
+    if (!m_framebuffers.empty()) {
+        glDeleteFramebuffers((GLsizei)m_framebuffers.size(), m_framebuffers.data());
+        m_framebuffers.clear();
+    }
+    glDeleteFramebuffers(1, &m_layeredframebuffer);
+    m_layeredframebuffer = 0;
+    glDeleteSamplers(1, &m_comparesampler);
+    m_comparesampler = 0;
+    glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+}
+
+void ShadowMap::bindLayer(int layer) const
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[layer]);
+    glViewport(0, 0, m_size, m_size);
+}
+
+void ShadowMap::bindLayers() const
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_layeredframebuffer);
+    glViewport(0, 0, m_size, m_size);
+}
+
+size_t ShadowMap::bytes() const
+{
+    return (size_t)m_size * m_size * m_layers * SHADOW_FORMATS[m_format].bytes;
+}
+
+const char* ShadowMap::formatName(int format)
+{
+    return SHADOW_FORMATS[format].name;
+}
+
+struct momentformat {
+    GLenum internalformat;
+    int bytes; // per texel
+    float maxexponent; // exp(2 * c) stays below the largest value
+    const char* name;
+};
+static const momentformat MOMENT_FORMATS[NUM_MOMENT_FORMATS] = {
+    { GL_RGBA16F, 8, 5.54f, "16 bit float" },
+    { GL_RGBA32F, 16, 42.0f, "32 bit float" },
+};
+
+ShadowMoments::ShadowMoments() :
+    m_texture(0),
+    m_scratch(0),
+    m_scratchframebuffer(0),
+    m_size(0),
+    m_layers(0),
+    m_format(SHADOW_MOMENTS32F)
+{
+}
+
+bool ShadowMoments::allocate(int size, int nlayers, int format)
+{
+    free();
+    m_size = size;
+    m_layers = nlayers;
+    m_format = format;
+    const momentformat& f = MOMENT_FORMATS[format];
+
+    // full mip chain, so distant receivers filter over wide areas
+    int nlevels = 1;
+    while ((size >> nlevels) > 0) {
+        nlevels++;
+    }
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+    for (int level = 0; level < nlevels; ++level) {
+        int s = std::max(1, size >> level);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, f.internalformat, s, s, nlayers, 0,
+            GL_RGBA, GL_FLOAT, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, nlevels - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenTextures(1, &m_scratch);
+    glBindTexture(GL_TEXTURE_2D, m_scratch);
+    glTexImage2D(GL_TEXTURE_2D, 0, f.internalformat, size, size, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    bool complete = true;
+    m_framebuffers.resize(nlayers);
+    glGenFramebuffers(nlayers, m_framebuffers.data());
+    for (int i = 0; i < nlayers; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_texture, 0, i);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            complete = false;
+        }
+    }
+    glGenFramebuffers(1, &m_scratchframebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_scratchframebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_scratch, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        complete = false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+void ShadowMoments::free()
+{
+    if (!m_framebuffers.empty()) {
+        glDeleteFramebuffers((GLsizei)m_framebuffers.size(), m_framebuffers.data());
+        m_framebuffers.clear();
+    }
+    glDeleteFramebuffers(1, &m_scratchframebuffer);
+    m_scratchframebuffer = 0;
+    glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+    glDeleteTextures(1, &m_scratch);
+    m_scratch = 0;
+}
+
+void ShadowMoments::bindLayer(int layer) const
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[layer]);
+    glViewport(0, 0, m_size, m_size);
+}
+
+void ShadowMoments::bindScratch() const
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_scratchframebuffer);
+    glViewport(0, 0, m_size, m_size);
+}
+
+void ShadowMoments::generateMipmaps() const
+{
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+size_t ShadowMoments::bytes() const
+{
+    size_t layer = (size_t)m_size * m_size * MOMENT_FORMATS[m_format].bytes;
+    // the mip chain adds about a third
+    return layer * m_layers * 4 / 3 + layer;
+}
+
+const char* ShadowMoments::formatName(int format)
+{
+    return MOMENT_FORMATS[format].name;
+}
+
+float ShadowMoments::maxExponent(int format)
+{
+    return MOMENT_FORMATS[format].maxexponent;
+}
+
+ShadowPyramid::ShadowPyramid() :
+    m_texture(0),
+    m_size(0),
+    m_layers(0),
+    m_levels(0)
+{
+}
+
+bool ShadowPyramid::allocate(int mapsize, int nlayers)
+{
+    free();
+    m_size = std::max(1, mapsize / 2);
+    m_layers = nlayers;
+    m_levels = 1;
+    while ((m_size >> m_levels) > 0) {
+        m_levels++;
+    }
+
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+    for (int level = 0; level < m_levels; ++level) {
+        int s = std::max(1, m_size >> level);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RG32F, s, s, nlayers, 0,
+            GL_RG, GL_FLOAT, nullptr);
+    }
+    // read with texelFetch only
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, m_levels - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    bool complete = true;
+    m_framebuffers.resize(nlayers * m_levels);
+    glGenFramebuffers((GLsizei)m_framebuffers.size(), m_framebuffers.data());
+    for (int i = 0; i < nlayers; ++i) {
+        for (int level = 0; level < m_levels; ++level) {
+            glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[i * m_levels + level]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_texture, level, i);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                complete = false;
+            }
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+void ShadowPyramid::free()
+{
+    if (!m_framebuffers.empty()) {
+        glDeleteFramebuffers((GLsizei)m_framebuffers.size(), m_framebuffers.data());
+        m_framebuffers.clear();
+    }
+    glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+}
+
+void ShadowPyramid::bindLevel(int layer, int level) const
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[layer * m_levels + level]);
+    int s = std::max(1, m_size >> level);
+    glViewport(0, 0, s, s);
+}
+
+void ShadowPyramid::readLevel(int level) const
+{
+    // the level being written must lie outside of base..max level,
+    // or rendering into it is a feedback loop
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, std::max(level, 0));
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, level < 0 ? m_levels - 1 : level);
+}
+
+size_t ShadowPyramid::bytes() const
+{
+    // 8 bytes per texel, the mip chain adds about a third
+    return (size_t)m_size * m_size * m_layers * 8 * 4 / 3;
+}
+
+DepthBuffer::DepthBuffer() :
+    m_texture(0),
+    m_width(0),
+    m_height(0)
+{
+}
+
+void DepthBuffer::allocate(int width, int height)
+{
+    if (m_texture && width == m_width && height == m_height) {
+        return;
+    }
+    free();
+    m_width = width;
+    m_height = height;
+
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0,
+        GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void DepthBuffer::free()
+{
+    glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+    m_width = 0;
+    m_height = 0;
+}
+
+void DepthBuffer::copyFromWindow() const
+{
+    // copies into depth textures read the depth of the read
+    // framebuffer, whatever its depth format
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, m_width, m_height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+size_t DepthBuffer::bytes() const
+{
+    return (size_t)m_width * m_height * 4;
+}
+
+bool ShadowAtlas::allocate(int size, int format)
+{
+    if (!m_map.allocate(size, 1, format)) {
+        return false;
+    }
+    // tiles are only cleared when they are rendered
+    m_map.bindLayer(0);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return true;
+}
+
+void ShadowAtlas::free()
+{
+    m_map.free();
+}
+
+// position of the n-th cell along a Z-order curve
+static void mortoncell(int n, int* x, int* y)
+{
+    *x = 0;
+    *y = 0;
+    for (int bit = 0; (n >> (2 * bit)) != 0; ++bit) {
+        *x |= ((n >> (2 * bit)) & 1) << bit;
+        *y |= ((n >> (2 * bit + 1)) & 1) << bit;
+    }
+}
+
+void ShadowAtlas::pack(const std::vector<int>& requests, std::vector<shadowtile>* tiles) const
+{
+    int grid = m_map.size() / MIN_TILE; // cells per side
+    int maxcells = std::max(1, grid / 4); // largest tile, in cells per side
+
+    // tile sides in cells, powers of two
+    int n = (int)requests.size();
+    std::vector<int> cells(n);
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        int c = 1;
+        while (c * 2 <= maxcells && c * 2 * MIN_TILE <= requests[i]) {
+            c *= 2;
+        }
+        cells[i] = c;
+        total += c * c;
+    }
+    // halve the largest tiles, the least important one among equals
+    // first, until everything fits or all tiles are as small as can be
+    while (total > grid * grid) {
+        int largest = -1;
+        for (int i = 0; i < n; ++i) {
+            if (cells[i] > 1 && (largest < 0 || cells[i] >= cells[largest])) {
+                largest = i;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        total -= cells[largest] * cells[largest] * 3 / 4;
+        cells[largest] /= 2;
+    }
+    // then drop the least important views
+    for (int i = n - 1; i >= 0 && total > grid * grid; --i) {
+        total -= cells[i] * cells[i];
+        cells[i] = 0;
+    }
+
+    // larger tiles first. with power of two sides in decreasing order,
+    // consecutive runs of a Z-order curve are always aligned squares,
+    // so the tiles fill the atlas without gaps.
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return cells[a] > cells[b];
+    });
+    tiles->assign(n, shadowtile{ 0, 0, 0 });
+    int cursor = 0;
+    for (int i : order) {
+        if (cells[i] == 0) {
+            continue;
+        }
+        int x, y;
+        mortoncell(cursor, &x, &y);
+        (*tiles)[i] = shadowtile{ x * MIN_TILE, y * MIN_TILE, cells[i] * MIN_TILE };
+        cursor += cells[i] * cells[i];
+    }
+}
+
+void ShadowAtlas::bindTile(const shadowtile& tile) const
+{
+    m_map.bindLayer(0);
+    glViewport(tile.x, tile.y, tile.size, tile.size);
+    glScissor(tile.x, tile.y, tile.size, tile.size);
+    glEnable(GL_SCISSOR_TEST);
+}
+
+void ShadowAtlas::unbindTile() const
+{
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// depth range of the light that covers every caster in the scene
+static void lightdepthrange(const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax, float* lightnear, float* lightfar)
+{
+    *lightnear = 1e30f;
+    *lightfar = -1e30f;
+    for (int i = 0; i < 8; ++i) {
+        Vector3f corner(i & 1 ? scenemax.x() : scenemin.x(),
+                        i & 2 ? scenemax.y() : scenemin.y(),
+                        i & 4 ? scenemax.z() : scenemin.z());
+        float z = -(lightview * Vector4f(corner, 1)).z();
+        *lightnear = std::min(*lightnear, z);
+        *lightfar = std::max(*lightfar, z);
+    }
+    float zpad = 0.01f * (*lightfar - *lightnear) + 0.01f;
+    *lightnear -= zpad;
+    *lightfar += zpad;
+}
+
+// far end of slice t (0..1) of the depth range, practical split scheme
+static float splitdistance(float znear, float zfar, float t, float lambda)
+{
+    float logsplit = znear * powf(zfar / znear, t);
+    float uniformsplit = znear + (zfar - znear) * t;
+    return lambda * logsplit + (1.0f - lambda) * uniformsplit;
+}
+
+void fitShadowCascades(shadowcascades* cascades, int count,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax,
+    int mapsize, float lambda)
+{
+    // depth range and field of view of the camera, read back from
+    // its perspective projection
+    float znear = P(2, 3) / (P(2, 2) - 1.0f);
+    float zfar = P(2, 3) / (P(2, 2) + 1.0f);
+    float tanx = 1.0f / P(0, 0);
+    float tany = 1.0f / P(1, 1);
+    Matrix4f camera = V.inverse();
+
+    float lightnear, lightfar;
+    lightdepthrange(lightview, scenemin, scenemax, &lightnear, &lightfar);
+
+    cascades->count = count;
+    float slicenear = znear;
+    for (int c = 0; c < count; ++c) {
+        float slicefar = splitdistance(znear, zfar, (float)(c + 1) / count, lambda);
+        cascades->splits[c] = slicefar;
+        cascades->view[c] = lightview;
+
+        // bounding sphere of the slice. its size does not depend on the
+        // camera orientation, so the projection only ever moves.
+        Vector3f corners[8];
+        Vector3f center(0, 0, 0);
+        for (int i = 0; i < 8; ++i) {
+            float d = i & 4 ? slicefar : slicenear;
+            Vector4f p(i & 1 ? d * tanx : -d * tanx,
+                       i & 2 ? d * tany : -d * tany, -d, 1);
+            corners[i] = (camera * p).xyz();
+            center += corners[i];
+            cascades->receivers[c][i] = corners[i];
+        }
+        center = center / 8.0f;
+        float radius = 0;
+        for (int i = 0; i < 8; ++i) {
+            radius = std::max(radius, (corners[i] - center).abs());
+        }
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        // snap the center to whole texels
+        float texel = 2.0f * radius / mapsize;
+        Vector3f lightcenter = (lightview * Vector4f(center, 1)).xyz();
+        float x = floorf(lightcenter.x() / texel) * texel;
+        float y = floorf(lightcenter.y() / texel) * texel;
+
+        cascades->projection[c] = Matrix4f::orthographicProjection(
+            x - radius, x + radius, y - radius, y + radius, lightnear, lightfar);
+        slicenear = slicefar;
+    }
+}
+
+// grows the light space bounds lo/hi by the part of the camera frustum
+// between view distances d0 and d1 behind the ndc rectangle x0..x1,
+// y0..y1. tolight maps camera view space to light view space.
+static void addfrustumpart(const Matrix4f& tolight, float tanx, float tany,
+    float x0, float x1, float y0, float y1, float d0, float d1, Vector3f* lo, Vector3f* hi)
+{
+    for (int i = 0; i < 8; ++i) {
+        float d = i & 4 ? d1 : d0;
+        Vector4f p((i & 1 ? x1 : x0) * d * tanx, (i & 2 ? y1 : y0) * d * tany, -d, 1);
+        Vector3f q = (tolight * p).xyz();
+        for (int k = 0; k < 3; ++k) {
+            (*lo)[k] = std::min((*lo)[k], q[k]);
+            (*hi)[k] = std::max((*hi)[k], q[k]);
+        }
+    }
+}
+
+bool fitSampledShadowCascades(shadowcascades* cascades, int count,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax,
+    const depthtiles& tiles, int mapsize, float lambda)
+{
+    float znear = P(2, 3) / (P(2, 2) - 1.0f);
+    float zfar = P(2, 3) / (P(2, 2) + 1.0f);
+    float tanx = 1.0f / P(0, 0);
+    float tany = 1.0f / P(1, 1);
+    // the camera of the samples
+    const Matrix4f& SP = tiles.projection;
+    float sampletanx = 1.0f / SP(0, 0);
+    float sampletany = 1.0f / SP(1, 1);
+    Matrix4f samplecamera = tiles.view.inverse();
+
+    int ntiles = tiles.size * tiles.size;
+    if ((int)tiles.ranges.size() < 2 * ntiles) {
+        return false;
+    }
+    // ndc of the tile grid lines. the outer ones move out by a tile to
+    // cover what the current view sees past the edge of the samples
+    float step = 2.0f / tiles.size;
+    std::vector<float> grid(tiles.size + 1);
+    for (int i = 0; i <= tiles.size; ++i) {
+        grid[i] = -1.0f + step * i;
+    }
+    grid[0] -= step;
+    grid[tiles.size] += step;
+
+    // every corner of the current frustum has to be among the samples
+    Matrix4f tosamples = tiles.view * V.inverse();
+    for (int i = 0; i < 4; ++i) {
+        Vector3f r = (tosamples * Vector4f(i & 1 ? tanx : -tanx, i & 2 ? tany : -tany, -1, 0)).xyz();
+        if (r.z() >= 0 ||
+            fabsf(r.x() / -r.z()) > sampletanx * grid[tiles.size] ||
+            fabsf(r.y() / -r.z()) > sampletany * grid[tiles.size]) {
+            return false;
+        }
+    }
+
+    // view depth in the current camera along a ray of the samples is
+    // linear in the sample distance d: origin + d * slope[ray]
+    float origin = -(V * Vector4f(samplecamera.getCol(3).xyz(), 1)).z();
+    std::vector<float> slope((tiles.size + 1) * (tiles.size + 1));
+    for (int y = 0; y <= tiles.size; ++y) {
+        for (int x = 0; x <= tiles.size; ++x) {
+            Vector4f ray = samplecamera * Vector4f(grid[x] * sampletanx, grid[y] * sampletany, -1, 0);
+            float b = -(V * ray).z();
+            if (b <= 0) {
+                // the camera turned too far for the samples to help
+                return false;
+            }
+            slope[y * (tiles.size + 1) + x] = b;
+        }
+    }
+    auto cornerslopes = [&](int i, float* lo, float* hi) {
+        int x = i % tiles.size;
+        int y = i / tiles.size;
+        int row = tiles.size + 1;
+        const float b[4] = { slope[y * row + x], slope[y * row + x + 1],
+                             slope[(y + 1) * row + x], slope[(y + 1) * row + x + 1] };
+        *lo = std::min(std::min(b[0], b[1]), std::min(b[2], b[3]));
+        *hi = std::max(std::max(b[0], b[1]), std::max(b[2], b[3]));
+    };
+
+    // sample distances of the nearest and farthest sample of every
+    // tile. depth buffer values map to distances as 1 / d does.
+    std::vector<float> distances(2 * ntiles);
+    float samplenear = zfar;
+    float samplefar = znear;
+    float samplezfar = SP(2, 3) / (SP(2, 2) + 1.0f);
+    for (int i = 0; i < ntiles; ++i) {
+        float lo = tiles.ranges[2 * i];
+        float hi = tiles.ranges[2 * i + 1];
+        if (lo > hi || lo >= 1.0f) {
+            // nothing but background
+            distances[2 * i] = 1.0f;
+            distances[2 * i + 1] = 0.0f;
+            continue;
+        }
+        float d0 = SP(2, 3) / (2.0f * lo - 1.0f + SP(2, 2));
+        float d1 = hi >= 1.0f ? samplezfar : SP(2, 3) / (2.0f * hi - 1.0f + SP(2, 2));
+        distances[2 * i] = d0;
+        distances[2 * i + 1] = d1;
+        float blo, bhi;
+        cornerslopes(i, &blo, &bhi);
+        samplenear = std::min(samplenear, origin + d0 * blo);
+        samplefar = std::max(samplefar, origin + d1 * bhi);
+    }
+    if (samplenear > samplefar) {
+        return false;
+    }
+    // leave room for objects that moved since
+    samplenear = std::max(znear, samplenear * 0.95f);
+    samplefar = std::min(zfar, samplefar * 1.05f);
+    if (samplenear >= samplefar) {
+        return false;
+    }
+
+    float lightnear, lightfar;
+    lightdepthrange(lightview, scenemin, scenemax, &lightnear, &lightfar);
+    Matrix4f tolight = lightview * samplecamera;
+
+    cascades->count = count;
+    float slicenear = samplenear;
+    for (int c = 0; c < count; ++c) {
+        float slicefar = splitdistance(samplenear, samplefar, (float)(c + 1) / count, lambda);
+        cascades->splits[c] = slicefar;
+        cascades->view[c] = lightview;
+
+        // bounds of the tiles' depth ranges within the slice. the part
+        // of a tile inside the slice lies between the sample distances
+        // where its nearest corner ray enters and its farthest one leaves
+        Vector3f lo(1e30f, 1e30f, 1e30f);
+        Vector3f hi(-1e30f, -1e30f, -1e30f);
+        for (int i = 0; i < ntiles; ++i) {
+            float blo, bhi;
+            cornerslopes(i, &blo, &bhi);
+            float d0 = std::max(distances[2 * i], (slicenear - origin) / bhi);
+            float d1 = std::min(distances[2 * i + 1], (slicefar - origin) / blo);
+            if (d0 > d1) {
+                continue;
+            }
+            int x = i % tiles.size;
+            int y = i / tiles.size;
+            addfrustumpart(tolight, sampletanx, sampletany,
+                grid[x], grid[x + 1], grid[y], grid[y + 1], d0, d1, &lo, &hi);
+        }
+        if (lo.x() > hi.x()) {
+            // no samples: no pixel should pick this cascade, but fit
+            // the whole slice in case one does
+            addfrustumpart(lightview * V.inverse(), tanx, tany, -1, 1, -1, 1,
+                slicenear, slicefar, &lo, &hi);
+        }
+        Matrix4f fromlight = lightview.inverse();
+        for (int i = 0; i < 8; ++i) {
+            Vector4f p(i & 1 ? hi.x() : lo.x(), i & 2 ? hi.y() : lo.y(), i & 4 ? hi.z() : lo.z(), 1);
+            cascades->receivers[c][i] = (fromlight * p).xyz();
+        }
+
+        // round the extent up and snap the corner to whole texels, so
+        // the projection only jumps when the bounds grow or shrink by
+        // a step, not while the camera pans a little
+        float extent = std::max(hi.x() - lo.x(), hi.y() - lo.y()) * 1.02f;
+        extent = ceilf(extent * 16.0f) / 16.0f;
+        float texel = extent / mapsize;
+        float x = floorf((0.5f * (lo.x() + hi.x() - extent)) / texel) * texel;
+        float y = floorf((0.5f * (lo.y() + hi.y() - extent)) / texel) * texel;
+        cascades->projection[c] = Matrix4f::orthographicProjection(
+            x, x + extent, y, y + extent, lightnear, lightfar);
+        slicenear = slicefar;
+    }
+    return true;
+}
+
+// keeps the part of a convex polygon on one side of an axis-aligned
+// plane: p[axis] >= bound if keepabove, p[axis] <= bound otherwise
+static void clippolygon(std::vector<Vector3f>* polygon, int axis, float bound, bool keepabove)
+{
+    std::vector<Vector3f> out;
+    size_t n = polygon->size();
+    for (size_t i = 0; i < n; ++i) {
+        const Vector3f& a = (*polygon)[i];
+        const Vector3f& b = (*polygon)[(i + 1) % n];
+        float da = keepabove ? a[axis] - bound : bound - a[axis];
+        float db = keepabove ? b[axis] - bound : bound - b[axis];
+        if (da >= 0) {
+            out.push_back(a);
+        }
+        if ((da >= 0) != (db >= 0)) {
+            out.push_back(a + (b - a) * (da / (da - db)));
+        }
+    }
+    *polygon = out;
+}
+
+void fitWarpedShadowMap(shadowcascades* cascades,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax, float strength)
+{
+    float znear = P(2, 3) / (P(2, 2) - 1.0f);
+    float zfar = P(2, 3) / (P(2, 2) + 1.0f);
+    float tanx = 1.0f / P(0, 0);
+    float tany = 1.0f / P(1, 1);
+    Matrix4f camera = V.inverse();
+
+    // the body to cover: the camera frustum clipped to the scene. its
+    // corners are those of the clipped frustum faces plus the corners
+    // of the scene bounds that lie inside the frustum.
+    Vector3f corners[8];
+    for (int i = 0; i < 8; ++i) {
+        float d = i & 4 ? zfar : znear;
+        Vector4f p(i & 1 ? d * tanx : -d * tanx,
+                   i & 2 ? d * tany : -d * tany, -d, 1);
+        corners[i] = (camera * p).xyz();
+    }
+    static const int FACES[6][4] = {
+        { 0, 1, 3, 2 }, { 4, 5, 7, 6 }, { 0, 2, 6, 4 },
+        { 1, 3, 7, 5 }, { 0, 1, 5, 4 }, { 2, 3, 7, 6 },
+    };
+    std::vector<Vector3f> body;
+    for (int f = 0; f < 6; ++f) {
+        std::vector<Vector3f> polygon;
+        for (int k = 0; k < 4; ++k) {
+            polygon.push_back(corners[FACES[f][k]]);
+        }
+        for (int axis = 0; axis < 3 && !polygon.empty(); ++axis) {
+            clippolygon(&polygon, axis, scenemin[axis], true);
+            clippolygon(&polygon, axis, scenemax[axis], false);
+        }
+        body.insert(body.end(), polygon.begin(), polygon.end());
+    }
+    for (int i = 0; i < 8; ++i) {
+        Vector3f corner(i & 1 ? scenemax.x() : scenemin.x(),
+                        i & 2 ? scenemax.y() : scenemin.y(),
+                        i & 4 ? scenemax.z() : scenemin.z());
+        Vector3f q = (V * Vector4f(corner, 1)).xyz();
+        float d = -q.z();
+        if (d >= znear && d <= zfar && fabsf(q.x()) <= d * tanx && fabsf(q.y()) <= d * tany) {
+            body.push_back(corner);
+        }
+    }
+    if (body.empty()) {
+        // nothing of the scene in view; any valid projection will do
+        body.assign(corners, corners + 8);
+    }
+
+    // turn the light view about its axis so y points along the view
+    // direction as seen from the light. the warp then stretches the
+    // map along y, towards the camera.
+    Vector3f viewdir = (lightview * Vector4f(-camera.getCol(2).xyz(), 0)).xyz();
+    Vector3f up(viewdir.x(), viewdir.y(), 0);
+    float singamma = up.abs();
+    if (singamma < 1e-3f) {
+        up = Vector3f(0, 1, 0);
+    }
+    up.normalize();
+    Matrix4f turn(up.y(), -up.x(), 0, 0,
+                  up.x(), up.y(), 0, 0,
+                  0, 0, 1, 0,
+                  0, 0, 0, 1);
+    Matrix4f lightspace = turn * lightview;
+
+    // body bounds in light space, and the depth range of all casters
+    Vector3f bmin(1e30f, 1e30f, 1e30f);
+    Vector3f bmax(-1e30f, -1e30f, -1e30f);
+    float bodynear = zfar;
+    float bodyfar = znear;
+    for (Vector3f& p : body) {
+        float d = -(V * Vector4f(p, 1)).z();
+        bodynear = std::min(bodynear, d);
+        bodyfar = std::max(bodyfar, d);
+        p = (lightspace * Vector4f(p, 1)).xyz();
+        for (int k = 0; k < 3; ++k) {
+            bmin[k] = std::min(bmin[k], p[k]);
+            bmax[k] = std::max(bmax[k], p[k]);
+        }
+    }
+    float lightlow = 1e30f;
+    float lighthigh = -1e30f;
+    for (int i = 0; i < 8; ++i) {
+        Vector3f corner(i & 1 ? scenemax.x() : scenemin.x(),
+                        i & 2 ? scenemax.y() : scenemin.y(),
+                        i & 4 ? scenemax.z() : scenemin.z());
+        float z = (lightspace * Vector4f(corner, 1)).z();
+        lightlow = std::min(lightlow, z);
+        lighthigh = std::max(lighthigh, z);
+    }
+
+    // LiSPSM: a perspective projection along y, with its center n in
+    // front of the body. the optimal n spreads the aliasing error evenly
+    // over the view depth; it grows as the view turns towards the light
+    // and the warp fades out. depth is the distance from the light,
+    // divided by the distance along y, which keeps its order along
+    // every light ray.
+    Matrix4f warp(1, 0, 0, 0,
+                  0, 1, 0, 0,
+                  0, 0, -1, 0,
+                  0, 0, 0, 1);
+    bodynear = std::max(bodynear, znear);
+    float nopt = (bodynear + sqrtf(bodynear * std::max(bodyfar, bodynear))) / std::max(singamma, 1e-3f);
+    float depth = bmax.y() - bmin.y();
+    if (strength > 0 && singamma >= 1e-3f && nopt / strength < 1e3f * depth) {
+        float n = nopt / strength;
+        float f = n + depth;
+        float a = (f + n) / (f - n);
+        float b = -2.0f * f * n / (f - n);
+        float cx = (lightspace * Vector4f(camera.getCol(3).xyz(), 1)).x();
+        float cy = bmin.y() - n;
+        float cz = 0.5f * (lightlow + lighthigh);
+        warp = Matrix4f(1, 0, 0, -cx,
+                        0, a, 0, -a * cy + b,
+                        0, 0, -1, cz,
+                        0, 1, 0, -cy);
+    }
+
+    // fit the warped body into the unit cube. the body is pushed along
+    // the light to the scene bounds, so all casters in front of it land
+    // in the depth range.
+    Vector3f wmin(1e30f, 1e30f, 1e30f);
+    Vector3f wmax(-1e30f, -1e30f, -1e30f);
+    for (const Vector3f& p : body) {
+        for (int k = 0; k < 2; ++k) {
+            Vector4f q = warp * Vector4f(p.x(), p.y(), k ? lighthigh : lightlow, 1);
+            Vector3f w = q.xyz() / q.w();
+            for (int j = 0; j < 3; ++j) {
+                wmin[j] = std::min(wmin[j], w[j]);
+                wmax[j] = std::max(wmax[j], w[j]);
+            }
+        }
+    }
+    float zpad = 0.01f * (wmax.z() - wmin.z()) + 1e-5f;
+    wmin[2] -= zpad;
+    wmax[2] += zpad;
+    Matrix4f fit = Matrix4f::identity();
+    for (int k = 0; k < 3; ++k) {
+        float extent = std::max(wmax[k] - wmin[k], 1e-6f);
+        fit(k, k) = 2.0f / extent;
+        fit(k, 3) = -(wmax[k] + wmin[k]) / extent;
+    }
+
+    cascades->count = 1;
+    cascades->view[0] = lightspace;
+    cascades->projection[0] = fit * warp;
+    cascades->splits[0] = zfar;
+    Matrix4f unproject = (cascades->projection[0] * lightspace).inverse();
+    for (int i = 0; i < 8; ++i) {
+        Vector4f p = unproject * Vector4f(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f,
+                                          i & 4 ? 1.0f : -1.0f, 1);
+        cascades->receivers[0][i] = p.xyz() / p.w();
+    }
+}
+
+ShadowCache::ShadowCache() :
+    m_hasdirection(false),
+    m_lightkey(0),
+    m_threshold(0.5f),
+    m_hits(0),
+    m_misses(0),
+    m_layersrendered(0),
+    m_layersdeferred(0)
+{
+    m_layers.rendered.count = 0;
+    invalidate();
+}
+
+Vector3f ShadowCache::lightDirection(const Vector3f& light_dir)
+{
+    float step = m_threshold * 3.141592f / 180.0f;
+    if (m_hasdirection && Vector3f::dot(light_dir, m_lightdir) >= cosf(step)) {
+        return m_lightdir;
+    }
+    // snap elevation and azimuth to multiples of the threshold angle
+    float elevation = asinf(std::max(-1.0f, std::min(light_dir.y(), 1.0f)));
+    float azimuth = atan2f(light_dir.x(), light_dir.z());
+    int32_t e = (int32_t)floorf(elevation / step + 0.5f);
+    int32_t a = (int32_t)floorf(azimuth / step + 0.5f);
+    elevation = e * step;
+    azimuth = a * step;
+    m_lightdir = Vector3f(cosf(elevation) * sinf(azimuth), sinf(elevation),
+                          cosf(elevation) * cosf(azimuth));
+    m_lightkey = ((uint64_t)(uint32_t)e << 32) | (uint32_t)a;
+    m_hasdirection = true;
+    return m_lightdir;
+}
+
+static bool samematrix(const Matrix4f& a, const Matrix4f& b)
+{
+    const float* pa = a;
+    const float* pb = b;
+    for (int i = 0; i < 16; ++i) {
+        if (pa[i] != pb[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// true if the projection of layer i still covers the given corners
+static bool coverscorners(const shadowcascades& cascades, int i, const Vector3f* corners)
+{
+    Matrix4f VP = cascades.projection[i] * cascades.view[i];
+    for (int k = 0; k < 8; ++k) {
+        Vector4f p = VP * Vector4f(corners[k], 1);
+        if (p.w() <= 0 || fabsf(p.x()) > p.w() || fabsf(p.y()) > p.w() || fabsf(p.z()) > p.w()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int ShadowCache::update(const shadowcascades& fitted, const int* layercost, int budget, bool amortize)
+{
+    if (fitted.count != m_layers.rendered.count) {
+        invalidate();
+    }
+    m_layers.rendered.count = fitted.count;
+
+    // the cascades are rebuilt from the same inputs every frame, so
+    // an unchanged layer gives exactly the same matrices
+    int mask = 0;
+    int due[MAX_CASCADES];
+    int ndue = 0;
+    for (int i = 0; i < fitted.count; ++i) {
+        // splits only depend on the camera projection
+        m_layers.rendered.splits[i] = fitted.splits[i];
+        ++m_layers.age[i];
+        if (!m_layers.valid[i]) {
+            mask |= 1 << i;
+            continue;
+        }
+        bool stale = !samematrix(fitted.view[i], m_layers.rendered.view[i]) ||
+            !samematrix(fitted.projection[i], m_layers.rendered.projection[i]);
+        if (!stale) {
+            continue;
+        }
+        // the splits above already moved, so a layer that misses part
+        // of its new slice would leave fragments without a shadow
+        if (!coverscorners(m_layers.rendered, i, fitted.receivers[i])) {
+            mask |= 1 << i;
+            continue;
+        }
+        if (amortize && m_layers.age[i] < (1 << i)) {
+            ++m_layersdeferred;
+            continue;
+        }
+        due[ndue++] = i;
+    }
+
+    // most overdue first, relative to the interval of each cascade
+    std::stable_sort(due, due + ndue, [this](int a, int b) {
+        return m_layers.age[a] * (1 << b) > m_layers.age[b] * (1 << a);
+    });
+    // layers rendered anyway are paid first; a frame that renders
+    // nothing else still takes the most overdue layer
+    int spent = 0;
+    for (int i = 0; i < fitted.count; ++i) {
+        if (mask & (1 << i)) {
+            spent += layercost[i];
+        }
+    }
+    for (int k = 0; k < ndue; ++k) {
+        int i = due[k];
+        if (amortize && mask && spent + layercost[i] > budget) {
+            m_layersdeferred += ndue - k;
+            break;
+        }
+        mask |= 1 << i;
+        spent += layercost[i];
+    }
+
+    for (int i = 0; i < fitted.count; ++i) {
+        if (mask & (1 << i)) {
+            m_layers.rendered.view[i] = fitted.view[i];
+            m_layers.rendered.projection[i] = fitted.projection[i];
+            std::copy(fitted.receivers[i], fitted.receivers[i] + 8, m_layers.rendered.receivers[i]);
+            m_layers.valid[i] = true;
+            m_layers.age[i] = 0;
+            ++m_layersrendered;
+        }
+    }
+    if (mask) {
+        ++m_misses;
+    }
+    else {
+        ++m_hits;
+    }
+    return mask;
+}
+
+void ShadowCache::invalidate()
+{
+    for (int i = 0; i < MAX_CASCADES; ++i) {
+        m_layers.valid[i] = false;
+        m_layers.age[i] = 0;
+    }
+}
+
+ShadowMapPool::ShadowMapPool() :
+    m_budget(0),
+    m_clock(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+bool ShadowMapPool::exchange(uint64_t from, uint64_t to, ShadowMap* map, ShadowCache* cache)
+{
+    int size = map->size();
+    int nlayers = map->layers();
+    int format = map->format();
+    size_t mapbytes = map->bytes();
+
+    entry parked;
+    parked.key = from;
+    parked.map = std::move(*map);
+    parked.layers = cache->layers();
+    parked.lastuse = ++m_clock;
+    m_entries.push_back(std::move(parked));
+
+    bool found = false;
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        if (m_entries[i].key == to) {
+            *map = std::move(m_entries[i].map);
+            cache->setLayers(m_entries[i].layers);
+            m_entries.erase(m_entries.begin() + i);
+            found = true;
+            break;
+        }
+    }
+    if (found) {
+        ++m_hits;
+    }
+    else {
+        ++m_misses;
+        if (bytes() + mapbytes <= m_budget) {
+            ShadowMap fresh;
+            if (fresh.allocate(size, nlayers, format)) {
+                *map = std::move(fresh);
+            }
+            else {
+                printf("Error, incomplete shadow map framebuffer\n");
+                fresh.free();
+            }
+        }
+        if (!map->texture()) {
+            // recycle the least recently used map; with a budget of 0,
+            // or when a new one failed, that may be the one just parked
+            int lru = leastrecent();
+            *map = std::move(m_entries[lru].map);
+            m_entries.erase(m_entries.begin() + lru);
+        }
+        cache->invalidate();
+    }
+    evict();
+    return found;
+}
+
+void ShadowMapPool::clear()
+{
+    for (entry& e : m_entries) {
+        e.map.free();
+    }
+    m_entries.clear();
+}
+
+void ShadowMapPool::setBudget(size_t bytes)
+{
+    m_budget = bytes;
+    evict();
+}
+
+size_t ShadowMapPool::bytes() const
+{
+    size_t total = 0;
+    for (const entry& e : m_entries) {
+        total += e.map.bytes();
+    }
+    return total;
+}
+
+void ShadowMapPool::evict()
+{
+    while (!m_entries.empty() && bytes() > m_budget) {
+        int lru = leastrecent();
+        m_entries[lru].map.free();
+        m_entries.erase(m_entries.begin() + lru);
+    }
+}
+
+int ShadowMapPool::leastrecent() const
+{
+    int lru = 0;
+    for (size_t i = 1; i < m_entries.size(); ++i) {
+        if (m_entries[i].lastuse < m_entries[lru].lastuse) {
+            lru = (int)i;
+        }
+    }
+    return lru;
+}
@@ -0,0 +1,428 @@
+#ifndef SHADOWMAP_H
+#define SHADOWMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "gl.h"
+#include "vecmath.h"
+
+// depth formats a shadow map can be allocated with
+enum { SHADOW_DEPTH16, SHADOW_DEPTH24, SHADOW_DEPTH32F, NUM_SHADOW_FORMATS };
+
+// upper limit of cascades; the shaders size their arrays with this
+const int MAX_CASCADES = 4;
+
+// how shading looks up the shadow map. the filterable ones read
+// blurred depth moments from a ShadowMoments texture instead of
+// comparing against the depth map; must match fragmentshader_dirlight.glsl
+enum { SHADOW_FILTER_HARD, SHADOW_FILTER_VSM, SHADOW_FILTER_EVSM, NUM_SHADOW_FILTERS };
+
+// float formats the depth moments can be stored in
+enum { SHADOW_MOMENTS16F, SHADOW_MOMENTS32F, NUM_MOMENT_FORMATS };
+
+// Depth-only render target for shadow maps: a 2D depth texture array
+// with one framebuffer per layer, plus a layered framebuffer that has
+// all layers attached at once. There is no color attachment.
+class ShadowMap {
+public:
+    ShadowMap();
+    // the GL objects have one owner: moving hands them over and leaves
+    // the source empty, copying is not allowed. free() releases them.
+    ShadowMap(ShadowMap&& other);
+    ShadowMap& operator=(ShadowMap&& other);
+    ShadowMap(const ShadowMap&) = delete;
+    ShadowMap& operator=(const ShadowMap&) = delete;
+
+    // (re)allocates nlayers layers of size x size texels.
+    // return false if the framebuffer is incomplete.
+    bool allocate(int size, int nlayers, int format);
+    void free();
+
+    // binds the framebuffer of one layer and sets the viewport to it
+    void bindLayer(int layer) const;
+    // binds the layered framebuffer and sets the viewport. a geometry
+    // shader picks the layer of each primitive with gl_Layer; clearing
+    // clears all layers.
+    void bindLayers() const;
+
+    // GL_TEXTURE_2D_ARRAY with one layer per cascade
+    GLuint texture() const { return m_texture; }
+    // sampler object for sampler2DArrayShadow lookups: depth compare
+    // and bilinear filtering of the results. the texture itself keeps
+    // plain depth reads, as the moments resolve and debug views need.
+    GLuint compareSampler() const { return m_comparesampler; }
+    int size() const { return m_size; }
+    int layers() const { return m_layers; }
+    int format() const { return m_format; }
+    // GPU memory used by the depth texture
+    size_t bytes() const;
+
+    static const char* formatName(int format);
+
+private:
+    uint32_t m_texture;
+    std::vector<uint32_t> m_framebuffers;
+    uint32_t m_layeredframebuffer;
+    uint32_t m_comparesampler;
+    int m_size;
+    int m_layers;
+    int m_format;
+};
+
+// Filterable shadow map: per cascade layer, moments of the depth in
+// the shadow map (VSM: depth and its square, EVSM: two exponentially
+// warped depths and their squares), stored in an RGBA float texture
+// array with mipmaps. Unlike depths, moments can be blurred and
+// filtered like colors, so soft shadows cost a single trilinear
+// lookup per pixel regardless of the blur radius.
+//
+// The moments are resolved from the depth map after each depth pass;
+// a scratch texture of one layer holds the result of the first of the
+// two blur passes.
+class ShadowMoments {
+public:
+    ShadowMoments();
+
+    // (re)allocates nlayers layers of size x size texels plus mipmaps.
+    // return false if a framebuffer is incomplete.
+    bool allocate(int size, int nlayers, int format);
+    void free();
+    bool allocated() const { return m_texture != 0; }
+
+    // bind the framebuffer of the top level of one layer, or of the
+    // scratch texture, and set the viewport to it
+    void bindLayer(int layer) const;
+    void bindScratch() const;
+    // rebuilds the mipmaps of all layers after some were rendered
+    void generateMipmaps() const;
+
+    // GL_TEXTURE_2D_ARRAY with one layer per cascade
+    GLuint texture() const { return m_texture; }
+    // GL_TEXTURE_2D of a single layer
+    GLuint scratch() const { return m_scratch; }
+    int size() const { return m_size; }
+    int layers() const { return m_layers; }
+    int format() const { return m_format; }
+    // GPU memory of the moments, their mipmaps and the scratch texture
+    size_t bytes() const;
+
+    static const char* formatName(int format);
+    // largest EVSM exponent whose squared moment still fits the format
+    static float maxExponent(int format);
+
+private:
+    uint32_t m_texture;
+    uint32_t m_scratch;
+    std::vector<uint32_t> m_framebuffers;
+    uint32_t m_scratchframebuffer;
+    int m_size;
+    int m_layers;
+    int m_format;
+};
+
+// Min/max depth pyramid of a shadow map, for the PCSS blocker search.
+// Level 0 has half the size of the map and holds the nearest and
+// farthest depth of 2 x 2 map texels; every further level reduces
+// 2 x 2 texels of the level below. A few texels of a coarse level
+// then bound all depths of a large area of the map.
+//
+// Levels are built by rendering into them while the texture only
+// exposes the level below, see readLevel().
+class ShadowPyramid {
+public:
+    ShadowPyramid();
+
+    // (re)allocates the pyramid of a mapsize x mapsize map with nlayers
+    // layers. return false if a framebuffer is incomplete.
+    bool allocate(int mapsize, int nlayers);
+    void free();
+    bool allocated() const { return m_texture != 0; }
+
+    // binds the framebuffer of one level of one layer and sets the
+    // viewport to it
+    void bindLevel(int layer, int level) const;
+    // binds the texture to the active unit and restricts it to one
+    // level, so a pass can read it while writing the next. level -1
+    // makes all levels readable again.
+    void readLevel(int level) const;
+
+    // GL_TEXTURE_2D_ARRAY, GL_RG32F, with one layer per cascade
+    GLuint texture() const { return m_texture; }
+    int levels() const { return m_levels; }
+    // size of level 0
+    int size() const { return m_size; }
+    size_t bytes() const;
+
+private:
+    uint32_t m_texture;
+    std::vector<uint32_t> m_framebuffers; // layer-major, m_levels per layer
+    int m_size;
+    int m_layers;
+    int m_levels;
+};
+
+// Depth texture the size of the window, holding a copy of the window's
+// depth after a depth prepass of the camera, for screen-space effects
+// such as contact shadows to read.
+class DepthBuffer {
+public:
+    DepthBuffer();
+
+    // (re)allocates width x height texels, unless it has that size
+    // already
+    void allocate(int width, int height);
+    void free();
+    bool allocated() const { return m_texture != 0; }
+
+    // copies the depth buffer of the window into the texture
+    void copyFromWindow() const;
+
+    // GL_TEXTURE_2D, 24 bit depth, nearest filtering
+    GLuint texture() const { return m_texture; }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    size_t bytes() const;
+
+private:
+    uint32_t m_texture;
+    int m_width;
+    int m_height;
+};
+
+// square region of the shadow atlas, in texels.
+// size is 0 for views that got no room.
+struct shadowtile {
+    int x;
+    int y;
+    int size;
+};
+
+// Shadow views of many lights packed into one depth texture of fixed
+// size, so memory stays the same however many lights there are.
+// Views ask for power of two tiles each frame; when these do not fit,
+// the largest requests shrink first and the least important views end
+// up without a tile.
+class ShadowAtlas {
+public:
+    // smallest tile, and the unit of the packing grid
+    static const int MIN_TILE = 64;
+
+    bool allocate(int size, int format);
+    void free();
+
+    // assigns a tile to each requested size. requests are rounded down
+    // to powers of two between MIN_TILE and a quarter of the atlas
+    // and have to be sorted by importance, most important first.
+    void pack(const std::vector<int>& requests, std::vector<shadowtile>* tiles) const;
+
+    // binds the framebuffer and restricts viewport and scissor box to
+    // the tile, so clears only touch the tile. unbindTile() turns the
+    // scissor test off again.
+    void bindTile(const shadowtile& tile) const;
+    void unbindTile() const;
+
+    // GL_TEXTURE_2D_ARRAY with a single layer
+    GLuint texture() const { return m_map.texture(); }
+    GLuint compareSampler() const { return m_map.compareSampler(); }
+    bool allocated() const { return m_map.texture() != 0; }
+    int size() const { return m_map.size(); }
+    size_t bytes() const { return m_map.bytes(); }
+
+private:
+    ShadowMap m_map;
+};
+
+// Cascades of a directional light. The camera frustum is split along
+// its depth range and each slice gets its own orthographic projection.
+struct shadowcascades {
+    int count;
+    // light view per cascade. fitShadowCascades() uses the same one for
+    // all of them, but cached cascades may stem from older light views.
+    Matrix4f view[MAX_CASCADES];
+    Matrix4f projection[MAX_CASCADES];
+    // far end of each cascade, as distance along the camera view axis
+    float splits[MAX_CASCADES];
+    // corners of a box around what each cascade has to cover, in world
+    // space. an older layer can stand in for a cascade only while they
+    // lie inside the projection it was rendered with.
+    Vector3f receivers[MAX_CASCADES][8];
+};
+
+// splits the frustum of the camera (V, P) into count slices and fits
+// an orthographic projection in lightview space around each of them.
+// lambda blends between uniform (0) and logarithmic (1) split distances.
+// scenemin/scenemax bound all shadow casters, so casters outside of a
+// slice still land in its depth range. Each projection is snapped to
+// whole texels of a mapsize x mapsize map to keep shadow edges stable
+// while the camera moves.
+void fitShadowCascades(shadowcascades* cascades, int count,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax,
+    int mapsize, float lambda = 0.5f);
+
+// nearest and farthest depth buffer value (0..1) within each tile of a
+// size x size grid over the screen, e.g. reduced from a depth pass of
+// the camera. tiles that only cover background have min >= 1.
+struct depthtiles {
+    int size;
+    std::vector<float> ranges; // min, max per tile, rows from the bottom
+    // camera the depth pass was rendered with
+    Matrix4f view;
+    Matrix4f projection;
+};
+
+// sample distribution shadow maps: like fitShadowCascades(), but the
+// splits divide the depth range the tiles actually hold, and each
+// cascade only covers the light space bounds of the tiles' depth
+// ranges within its slice. Indoors this leaves no texels to empty
+// space behind walls or outside the view. The tiles may be a few
+// frames old: they are placed with the camera they were taken with and
+// sliced along the view axis of the current one (V, P), and the edge
+// tiles reach one tile further out. return false, leaving cascades
+// untouched, if the tiles hold no geometry or the current view sees
+// more than that margin past them.
+bool fitSampledShadowCascades(shadowcascades* cascades, int count,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax,
+    const depthtiles& tiles, int mapsize, float lambda = 0.5f);
+
+// fits a single light space perspective shadow map (LiSPSM) to the part
+// of the camera frustum inside the scene bounds. the projection is
+// warped along the view direction as seen from the light, so texels
+// get smaller towards the camera, much like cascades do. strength
+// scales the warp: 1 is the optimum of the LiSPSM paper, 0 gives a
+// plain orthographic fit. the warp fades out when looking along the
+// light, where it could not help. Unlike cascades, the projection moves
+// with every camera change and cannot be snapped to texels.
+void fitWarpedShadowMap(shadowcascades* cascades,
+    const Matrix4f& V, const Matrix4f& P, const Matrix4f& lightview,
+    const Vector3f& scenemin, const Vector3f& scenemax, float strength = 1.0f);
+
+// what the layers of a shadow map hold, see ShadowCache
+struct shadowlayers {
+    shadowcascades rendered;
+    bool valid[MAX_CASCADES];
+    int age[MAX_CASCADES]; // frames since the layer was rendered
+};
+
+// Decides which layers of the shadow map have to be rendered again.
+// The light direction used for shadows only follows the real one once
+// they are more than a threshold angle apart, so a slowly moving light
+// does not invalidate the map every frame. It then snaps to a grid of
+// directions with the threshold as spacing, which gives every shadow
+// direction a key (see lightKey()). A layer is reused as long as the
+// cascade it was rendered with is unchanged.
+//
+// Stale layers are refreshed on a schedule: cascade i is due at most
+// every 2^i frames, so the near cascade follows the light every frame
+// and far ones lag behind. The due layers are rendered most overdue
+// first until their cost would exceed a budget per frame. A stale layer whose
+// projection no longer covers the receivers of its cascade, e.g.
+// after the camera moved, is rendered right away instead. Shading has
+// to use the cascades the layers were actually rendered with, see
+// rendered().
+class ShadowCache {
+public:
+    ShadowCache();
+
+    // returns the light direction to render shadows with
+    Vector3f lightDirection(const Vector3f& light_dir);
+    // grid cell of the direction last returned by lightDirection()
+    uint64_t lightKey() const { return m_lightkey; }
+
+    // compares the fitted cascades with those in the map and returns a
+    // bit mask of the layers to render this frame. layercost[i] is what
+    // rendering layer i costs, e.g. in triangles; the picked layers stay
+    // within budget, except layers that hold nothing valid yet or miss
+    // receivers of their cascade, which are always rendered, and one
+    // layer in a frame that would otherwise render none.
+    // amortize = false refreshes every stale layer right away.
+    int update(const shadowcascades& fitted, const int* layercost, int budget,
+        bool amortize = true);
+
+    // the cascades the layers hold once the layers returned by the
+    // last update() are rendered
+    const shadowcascades& rendered() const { return m_layers.rendered; }
+
+    // state of all layers, for moving a map in and out of a ShadowMapPool
+    const shadowlayers& layers() const { return m_layers; }
+    void setLayers(const shadowlayers& layers) { m_layers = layers; }
+
+    // marks all layers invalid, e.g. after the map was reallocated
+    // or the scene or depth shaders changed
+    void invalidate();
+
+    void setAngleThreshold(float degrees) { m_threshold = degrees; }
+    float angleThreshold() const { return m_threshold; }
+
+    // frames that rendered no layer, frames that rendered some
+    int hits() const { return m_hits; }
+    int misses() const { return m_misses; }
+    // layers rendered, stale layers postponed to a later frame
+    int layersRendered() const { return m_layersrendered; }
+    int layersDeferred() const { return m_layersdeferred; }
+
+private:
+    shadowlayers m_layers;
+    bool m_hasdirection;
+    Vector3f m_lightdir;
+    uint64_t m_lightkey;
+    float m_threshold; // degrees
+    int m_hits;
+    int m_misses;
+    int m_layersrendered;
+    int m_layersdeferred;
+};
+
+// LRU cache of shadow maps keyed by light direction (ShadowCache::
+// lightKey()), for lights that keep returning to directions they had
+// before. When the shadow direction changes, the map in use is parked
+// in the pool together with the state of its layers, and a map parked
+// earlier for the new direction is taken out again. Its layers are
+// then reused as long as their cascades still match, i.e. while the
+// camera has not moved in between.
+//
+// Parked maps are held within a memory budget; the least recently used
+// ones are recycled first.
+class ShadowMapPool {
+public:
+    ShadowMapPool();
+
+    // parks *map under key from and puts the map for key to in its
+    // place. return true if the pool had one; otherwise *map is a
+    // recycled or new map with all layers invalid.
+    bool exchange(uint64_t from, uint64_t to, ShadowMap* map, ShadowCache* cache);
+
+    // frees all parked maps
+    void clear();
+
+    void setBudget(size_t bytes);
+    size_t budget() const { return m_budget; }
+    // memory held by parked maps
+    size_t bytes() const;
+    int size() const { return (int)m_entries.size(); }
+
+    // exchanges that found a parked map, and those that did not
+    int hits() const { return m_hits; }
+    int misses() const { return m_misses; }
+
+private:
+    struct entry {
+        uint64_t key;
+        ShadowMap map;
+        shadowlayers layers;
+        uint64_t lastuse;
+    };
+    // frees least recently used maps until the pool fits its budget
+    void evict();
+    int leastrecent() const;
+
+    std::vector<entry> m_entries;
+    size_t m_budget;
+    uint64_t m_clock;
+    int m_hits;
+    int m_misses;
+};
+
+#endif
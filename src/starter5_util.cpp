@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <sys/stat.h>
 // defined later in this file
 void setupDebugPrint();
 void printOpenGLVersion();
@@ -105,7 +106,8 @@ static bool compileShader(GLuint handle, GLenum stype, const char* src)
 		int nwritten;
 		glGetShaderInfoLog(handle, 2048, &nwritten, buff);
 
-		const char* typelabel = stype == GL_VERTEX_SHADER ? "vertex" : (stype == GL_FRAGMENT_SHADER ? "fragment" : "unknown");
+		const char* typelabel = stype == GL_VERTEX_SHADER ? "vertex" : (stype == GL_FRAGMENT_SHADER ? "fragment" :
+			(stype == GL_GEOMETRY_SHADER ? "geometry" : "unknown"));
 		printf("Error in %s shader\n%s\n", typelabel, buff);
 		return false;
 	}
@@ -121,10 +123,13 @@ static int compileShader(GLenum type, const char* src)
 }
 
 
-static bool linkProgram(GLuint handle, GLuint vshader, GLuint fshader)
+static bool linkProgram(GLuint handle, GLuint vshader, GLuint fshader, GLuint gshader)
 {
 	glAttachShader(handle, vshader);
 	glAttachShader(handle, fshader);
+	if (gshader) {
+		glAttachShader(handle, gshader);
+	}
 	glLinkProgram(handle);
 	int success;
 	glGetProgramiv(handle, GL_LINK_STATUS, &success);
@@ -138,12 +143,13 @@ static bool linkProgram(GLuint handle, GLuint vshader, GLuint fshader)
 	return true;
 }
 
-uint32_t compileProgram(const char* vshader_src, const char* fshader_src)
+uint32_t compileProgram(const char* vshader_src, const char* fshader_src, const char* gshader_src)
 {
 	GLuint program = glCreateProgram();
 	GLuint vshader = compileShader(GL_VERTEX_SHADER, vshader_src);
 	GLuint fshader = compileShader(GL_FRAGMENT_SHADER, fshader_src);
-	if (!linkProgram(program, vshader, fshader)) {
+	GLuint gshader = gshader_src ? compileShader(GL_GEOMETRY_SHADER, gshader_src) : 0;
+	if (!linkProgram(program, vshader, fshader, gshader)) {
 		glDeleteProgram(program);
 		program = 0;
 	}
@@ -151,12 +157,33 @@ uint32_t compileProgram(const char* vshader_src, const char* fshader_src)
 	// shader objects should be deleted
 	glDeleteShader(vshader);
 	glDeleteShader(fshader);
+	if (gshader) {
+		glDeleteShader(gshader);
+	}
 	return program;
 }
-uint32_t compileProgramFromFile(const char* vertexshaderfile, const char* fragmentshaderfile) {
-    std::string vs= readfile(vertexshaderfile);
-    std::string fs= readfile(fragmentshaderfile);
-    return compileProgram(vs.c_str(), fs.c_str());
+// #version has to stay the first line
+static std::string insertdefines(const std::string& src, const char* defines) {
+    if (!defines) {
+        return src;
+    }
+    size_t pos = 0;
+    if (src.compare(0, 8, "#version") == 0) {
+        pos = src.find('\n');
+        pos = pos == std::string::npos ? src.size() : pos + 1;
+    }
+    return src.substr(0, pos) + defines + src.substr(pos);
+}
+
+uint32_t compileProgramFromFile(const char* vertexshaderfile, const char* fragmentshaderfile,
+    const char* geometryshaderfile, const char* defines) {
+    std::string vs= insertdefines(readfile(vertexshaderfile), defines);
+    std::string fs= insertdefines(readfile(fragmentshaderfile), defines);
+    if (!geometryshaderfile) {
+        return compileProgram(vs.c_str(), fs.c_str());
+    }
+    std::string gs= insertdefines(readfile(geometryshaderfile), defines);
+    return compileProgram(vs.c_str(), fs.c_str(), gs.c_str());
 }
 
 std::string readfile(const std::string& fname) {
@@ -169,6 +196,76 @@ std::string readfile(const std::string& fname) {
     return cppstr;
 }
 
+const double filewatcher::POLL_INTERVAL = 0.25;
+
+filewatcher::filewatcher() :
+    m_lastpoll(0)
+{
+}
+
+// 64 bit FNV-1a hash of a string
+static uint64_t hashstring(const std::string& s) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < s.size(); ++i) {
+        h = (h ^ (uint8_t)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+void filewatcher::stamp(watchedfile* f) {
+    struct stat st;
+    if (stat(f->name.c_str(), &st) != 0) {
+        f->size = -1;
+        f->mtime = 0;
+        return;
+    }
+    f->size = (int64_t)st.st_size;
+    f->mtime = (int64_t)st.st_mtime;
+}
+
+void filewatcher::watch(const std::string& fname) {
+    for (const watchedfile& f : m_files) {
+        if (f.name == fname) {
+            return;
+        }
+    }
+    watchedfile f;
+    f.name = fname;
+    stamp(&f);
+    f.hash = hashstring(readfile(fname));
+    m_files.push_back(f);
+}
+
+void filewatcher::clear() {
+    m_files.clear();
+}
+
+bool filewatcher::poll() {
+    double now = glfwGetTime();
+    if (now - m_lastpoll < POLL_INTERVAL) {
+        return false;
+    }
+    m_lastpoll = now;
+
+    bool changed = false;
+    for (watchedfile& f : m_files) {
+        int64_t size = f.size;
+        int64_t mtime = f.mtime;
+        stamp(&f);
+        if (f.size == size && f.mtime == mtime) {
+            continue;
+        }
+        // only read the file when its stamp moved. editors often
+        // rewrite a file without changing it, which should not count.
+        uint64_t hash = hashstring(readfile(f.name));
+        if (hash != f.hash) {
+            f.hash = hash;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
 
 void printOpenGLVersion()
 {
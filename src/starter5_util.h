@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 #include "gl.h"
 
 float deg2rad(float deg);
@@ -14,8 +15,45 @@ GLFWwindow* createOpenGLWindow(int width, int height, const char* title);
 
 // returns 0 on error
 // program must be freed with glDeleteProgram()
-uint32_t compileProgram(const char* vertexshader, const char* fragmentshader);
-uint32_t compileProgramFromFile(const char* vertexshaderfile, const char* fragmentshaderfile);
+// the geometry shader is optional
+uint32_t compileProgram(const char* vertexshader, const char* fragmentshader,
+    const char* geometryshader = nullptr);
+// defines (e.g. "#define A 1\n") are inserted after the #version line
+// of every shader file, to build variants of the same sources
+uint32_t compileProgramFromFile(const char* vertexshaderfile, const char* fragmentshaderfile,
+    const char* geometryshaderfile = nullptr, const char* defines = nullptr);
 
 std::string readfile(const std::string& fname);
+
+// polls a set of files for changes, e.g. shaders that are edited while
+// the program is running. A file counts as changed when its size or
+// modification time differ and its contents hash differently, so saving
+// a file without edits does not report a change.
+class filewatcher {
+public:
+    filewatcher();
+
+    // start watching fname. its current contents count as unchanged.
+    void watch(const std::string& fname);
+    void clear();
+
+    // return true if any watched file changed since the last call.
+    // the files are only stat'ed every POLL_INTERVAL seconds, so
+    // calling this every frame is cheap.
+    bool poll();
+
+    static const double POLL_INTERVAL;
+
+private:
+    struct watchedfile {
+        std::string name;
+        int64_t size; // -1 if the file is missing
+        int64_t mtime;
+        uint64_t hash;
+    };
+    static void stamp(watchedfile* f);
+
+    std::vector<watchedfile> m_files;
+    double m_lastpoll;
+};
 #endif
@@ -0,0 +1,123 @@
+#include "staticmesh.h"
+
+#include <vector>
+#include <cstddef>
+#include "objparser.h"
+
+// layout of the non-position attributes of one vertex.
+// positions live in their own tightly packed buffer.
+struct staticattributes {
+    float normal[3];
+    float texcoord[2];
+};
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "positions are uploaded as they are");
+
+StaticMesh::StaticMesh() :
+    m_vertexarray(0),
+    m_positionarray(0),
+    m_positionbuffer(0),
+    m_attributebuffer(0),
+    m_indexbuffer(0)
+{
+}
+
+void StaticMesh::upload(const objparser& scene)
+{
+    free();
+
+    // positions are uploaded as they are, the remaining
+    // attributes are interleaved on the CPU once
+    size_t nverts = scene.positions.size();
+    std::vector<staticattributes> attributes(nverts);
+    for (size_t i = 0; i < nverts; ++i) {
+        staticattributes& a = attributes[i];
+        for (int k = 0; k < 3; ++k) {
+            a.normal[k] = scene.normals[i][k];
+        }
+        a.texcoord[0] = scene.texcoords[i][0];
+        a.texcoord[1] = scene.texcoords[i][1];
+    }
+
+    glGenBuffers(1, &m_positionbuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionbuffer);
+    glBufferData(GL_ARRAY_BUFFER, nverts * sizeof(float) * 3,
+        scene.positions.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &m_attributebuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_attributebuffer);
+    glBufferData(GL_ARRAY_BUFFER, attributes.size() * sizeof(staticattributes),
+        attributes.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &m_indexbuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexbuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, scene.indices.size() * sizeof(uint32_t),
+        scene.indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // full vertex array for shading
+    glGenVertexArrays(1, &m_vertexarray);
+    glBindVertexArray(m_vertexarray);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionbuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_attributebuffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(staticattributes),
+        (void*)offsetof(staticattributes, normal));
+    // the shaders read texture coordinates from the color attribute.
+    // the missing third component defaults to 0.
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(staticattributes),
+        (void*)offsetof(staticattributes, texcoord));
+
+    // the element buffer binding is part of the vertex array state
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexbuffer);
+
+    // position-only vertex array for depth passes
+    glGenVertexArrays(1, &m_positionarray);
+    glBindVertexArray(m_positionarray);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionbuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexbuffer);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void StaticMesh::bind() const
+{
+    glBindVertexArray(m_vertexarray);
+}
+
+void StaticMesh::bindPositions() const
+{
+    glBindVertexArray(m_positionarray);
+}
+
+void StaticMesh::draw(int start_index, int nindices, GLenum mode) const
+{
+    if (nindices <= 0) {
+        return;
+    }
+    glDrawElements(mode, nindices, GL_UNSIGNED_INT,
+        (void*)(start_index * sizeof(uint32_t)));
+}
+
+void StaticMesh::free()
+{
+    glDeleteBuffers(1, &m_indexbuffer);
+    glDeleteBuffers(1, &m_attributebuffer);
+    glDeleteBuffers(1, &m_positionbuffer);
+    glDeleteVertexArrays(1, &m_positionarray);
+    glDeleteVertexArrays(1, &m_vertexarray);
+    m_indexbuffer = 0;
+    m_attributebuffer = 0;
+    m_positionbuffer = 0;
+    m_positionarray = 0;
+    m_vertexarray = 0;
+}
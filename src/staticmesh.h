@@ -0,0 +1,44 @@
+#ifndef STATICMESH_H
+#define STATICMESH_H
+
+#include <cstdint>
+#include "gl.h"
+
+class objparser;
+
+// Scene geometry that lives on the GPU for the lifetime of the program.
+// Positions are stored tightly packed in one VBO, the remaining
+// attributes interleaved in a second one, indices in an element buffer.
+// Each draw call then only binds a vertex array and draws a range of
+// indices; nothing is uploaded per frame. Depth-only passes bind a
+// vertex array that fetches nothing but positions.
+//
+// Attribute locations match vertexshader.glsl:
+//   0: position, 1: normal, 2: texture coordinate (passed as Color).
+class StaticMesh {
+public:
+    StaticMesh();
+
+    // uploads positions, normals, texcoords and indices of a parsed
+    // scene. Replaces any previously uploaded data.
+    void upload(const objparser& scene);
+
+    // binds the vertex array. call once before a series of draw() calls.
+    void bind() const;
+    // binds a vertex array with only attribute 0 (position) enabled.
+    void bindPositions() const;
+    // draws nindices indices starting at start_index.
+    void draw(int start_index, int nindices, GLenum mode = GL_TRIANGLES) const;
+
+    // releases the GPU buffers.
+    void free();
+
+private:
+    uint32_t m_vertexarray;
+    uint32_t m_positionarray;
+    uint32_t m_positionbuffer;
+    uint32_t m_attributebuffer;
+    uint32_t m_indexbuffer;
+};
+
+#endif
@@ -2,13 +2,172 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include "gl.h"
 
 #ifndef M_PIf
 #define M_PIf 3.141592f
 #endif
 
-VertexRecorder::VertexRecorder() :m_nverts(0)
+// Shared streaming state of all VertexRecorders.
+// Vertices are appended to one interleaved buffer that is used as a
+// ring. When ARB_buffer_storage is available the buffer is mapped
+// persistently and the ring is split into segments, each guarded by a
+// fence, so the CPU only waits if it catches up with the GPU.
+// Otherwise the buffer is orphaned on wrap-around and written with
+// unsynchronized mappings, which lets the driver hand out fresh
+// storage instead of stalling.
+static const int STREAM_SEGMENTS = 4;
+static const size_t STREAM_INITIAL_BYTES = 1 << 20;
+
+struct vertexstream {
+    uint32_t vertexarray;
+    uint32_t buffer;
+    size_t vertexsize;  // bytes per vertex
+    size_t capacity;    // ring capacity in vertices
+    size_t head;        // next vertex to write
+    int openseg;        // first segment written since the last fence
+    bool persistent;
+    uint8_t* mapped;    // persistent mapping, if any
+    GLsync fences[STREAM_SEGMENTS];
+    size_t streamed;    // bytes written since resetStreamCounter()
+};
+static vertexstream s_stream;
+
+static size_t streamSegment(size_t vertex)
+{
+    size_t segsize = s_stream.capacity / STREAM_SEGMENTS;
+    size_t seg = vertex / segsize;
+    return seg < STREAM_SEGMENTS ? seg : STREAM_SEGMENTS - 1;
+}
+
+static void fenceSegments(size_t end)
+{
+    // fence the segments in [openseg, end). they are not written again
+    // until the ring wraps around.
+    if (!s_stream.persistent) {
+        return;
+    }
+    for (size_t seg = s_stream.openseg; seg < end; ++seg) {
+        // a segment not written during the last lap still holds its
+        // previous fence, which the new one supersedes
+        if (s_stream.fences[seg]) {
+            glDeleteSync(s_stream.fences[seg]);
+        }
+        s_stream.fences[seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    s_stream.openseg = (int)end;
+}
+
+static void waitSegments(size_t first, size_t last)
+{
+    for (size_t seg = first; seg <= last; ++seg) {
+        GLsync fence = s_stream.fences[seg];
+        if (!fence) {
+            continue;
+        }
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        while (status == GL_TIMEOUT_EXPIRED) {
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+        glDeleteSync(fence);
+        s_stream.fences[seg] = 0;
+    }
+}
+
+static void allocStream(size_t vertexsize, size_t capacity)
+{
+    VertexRecorder::freeStream();
+    s_stream.vertexsize = vertexsize;
+    s_stream.capacity = capacity;
+
+    glGenVertexArrays(1, &s_stream.vertexarray);
+    glBindVertexArray(s_stream.vertexarray);
+    glGenBuffers(1, &s_stream.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, s_stream.buffer);
+
+    size_t nbytes = capacity * vertexsize;
+#ifndef __APPLE__
+    s_stream.persistent = GLEW_ARB_buffer_storage != 0;
+    if (s_stream.persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, nbytes, nullptr, flags);
+        s_stream.mapped = (uint8_t*)glMapBufferRange(GL_ARRAY_BUFFER, 0, nbytes, flags);
+        if (!s_stream.mapped) {
+            // immutable storage can't be respecified, start over with a
+            // plain buffer
+            glDeleteBuffers(1, &s_stream.buffer);
+            glGenBuffers(1, &s_stream.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, s_stream.buffer);
+            s_stream.persistent = false;
+        }
+    }
+#endif
+    if (!s_stream.persistent) {
+        glBufferData(GL_ARRAY_BUFFER, nbytes, nullptr, GL_STREAM_DRAW);
+    }
+
+    // position, normal and color are interleaved
+    for (int attrib = 0; attrib < 3; ++attrib) {
+        glEnableVertexAttribArray(attrib);
+        glVertexAttribPointer(attrib,
+            3,
+            GL_FLOAT,
+            GL_FALSE,
+            (GLsizei)vertexsize,
+            (void*)(attrib * 3 * sizeof(float)));
+    }
+}
+
+// copies nverts vertices into the ring and returns the index of the
+// first one. leaves the stream vertex array and buffer bound.
+static size_t streamVertices(const void* data, size_t nverts, size_t vertexsize)
+{
+    if (!s_stream.vertexarray || s_stream.vertexsize != vertexsize ||
+        nverts > s_stream.capacity) {
+        size_t capacity = STREAM_INITIAL_BYTES / vertexsize;
+        while (capacity < nverts) {
+            capacity *= 2;
+        }
+        allocStream(vertexsize, capacity);
+    }
+    glBindVertexArray(s_stream.vertexarray);
+    glBindBuffer(GL_ARRAY_BUFFER, s_stream.buffer);
+
+    size_t nbytes = nverts * vertexsize;
+    if (s_stream.head + nverts > s_stream.capacity) {
+        // wrap around
+        fenceSegments(STREAM_SEGMENTS);
+        s_stream.head = 0;
+        s_stream.openseg = 0;
+        if (!s_stream.persistent) {
+            glBufferData(GL_ARRAY_BUFFER, s_stream.capacity * vertexsize,
+                nullptr, GL_STREAM_DRAW);
+        }
+    }
+    size_t first = s_stream.head;
+    size_t offset = first * vertexsize;
+    if (s_stream.persistent) {
+        waitSegments(streamSegment(first), streamSegment(first + nverts - 1));
+        memcpy(s_stream.mapped + offset, data, nbytes);
+    }
+    else {
+        void* dst = glMapBufferRange(GL_ARRAY_BUFFER, offset, nbytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (dst) {
+            memcpy(dst, data, nbytes);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        else {
+            glBufferSubData(GL_ARRAY_BUFFER, offset, nbytes, data);
+        }
+    }
+    s_stream.head += nverts;
+    s_stream.streamed += nbytes;
+    return first;
+}
+
+VertexRecorder::VertexRecorder()
 {
 }
 
@@ -24,82 +183,53 @@ void VertexRecorder::record_poscolor(Vector3f pos,
 void VertexRecorder::record(Vector3f pos,
     Vector3f normal,
     Vector3f color) {
-    m_position.push_back(pos);
-    m_normal.push_back(normal);
-    m_color.push_back(color);
-    m_nverts++;
+    vertex v = { pos, normal, color };
+    m_vertices.push_back(v);
 }
 
-/* This implementation uploads data to the GPU on each draw call.
-   A more efficient implementation would only upload when the vertex
-   data changed.
-*/
 void VertexRecorder::draw(GLenum mode)
 {
-    if (m_nverts == 0) {
+    if (m_vertices.empty()) {
         return;
     }
-    // upload data to GPU
-    uint32_t vertexarray;
-    glGenVertexArrays(1, &vertexarray);
-    glBindVertexArray(vertexarray);
-    uint32_t vertexbuffer[3];
-    glGenBuffers(3, vertexbuffer);
-
-    // POSITION
-    glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer[0]);
-    size_t position_nbytes = m_nverts * sizeof(m_position[0]);
-    glBufferData(GL_ARRAY_BUFFER, position_nbytes,
-        m_position.data(), GL_DYNAMIC_DRAW);
-
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0,
-        3,
-        GL_FLOAT,
-        GL_FALSE,
-        sizeof(m_position[0]),
-        (void*)0);
-
-    // NORMALS
-    glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer[1]);
-    size_t normal_nbytes = m_nverts * sizeof(m_normal[0]);
-    glBufferData(GL_ARRAY_BUFFER, normal_nbytes,
-        m_normal.data(), GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1,
-        3,
-        GL_FLOAT,
-        GL_FALSE,
-        sizeof(m_normal[0]),
-        (void*)0);
-
-    // COLOR
-    glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer[2]);
-    size_t color_nbytes = m_nverts * sizeof(m_color[0]);
-    glBufferData(GL_ARRAY_BUFFER, color_nbytes,
-        m_color.data(), GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2,
-        3,
-        GL_FLOAT,
-        GL_FALSE,
-        sizeof(m_color[0]),
-        (void*)0);
-
-    // Everything is uploaded.
-    // Now draw.
-    glDrawArrays(mode, 0, m_nverts);
-
-    // Release allocated buffers/arrays.
-    glDeleteBuffers(3, vertexbuffer);
-    glDeleteVertexArrays(1, &vertexarray);
+    size_t nverts = m_vertices.size();
+    size_t first = streamVertices(m_vertices.data(), nverts, sizeof(vertex));
+    glDrawArrays(mode, (GLint)first, (GLsizei)nverts);
+    // segments the head has moved past are done once this draw is
+    fenceSegments(streamSegment(s_stream.head));
+    glBindVertexArray(0);
 }
 void VertexRecorder::clear()
 {
-    m_nverts = 0;
-    m_position.clear();
-    m_normal.clear();
-    m_color.clear();
+    m_vertices.clear();
+}
+
+size_t VertexRecorder::streamedBytes()
+{
+    return s_stream.streamed;
+}
+
+void VertexRecorder::resetStreamCounter()
+{
+    s_stream.streamed = 0;
+}
+
+void VertexRecorder::freeStream()
+{
+    for (int seg = 0; seg < STREAM_SEGMENTS; ++seg) {
+        if (s_stream.fences[seg]) {
+            glDeleteSync(s_stream.fences[seg]);
+        }
+    }
+    if (s_stream.mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, s_stream.buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    glDeleteBuffers(1, &s_stream.buffer);
+    glDeleteVertexArrays(1, &s_stream.vertexarray);
+    size_t streamed = s_stream.streamed;
+    s_stream = vertexstream();
+    s_stream.streamed = streamed;
 }
 
 void drawSphere(float r, int slices, int stacks) {
@@ -107,8 +237,9 @@ void drawSphere(float r, int slices, int stacks) {
     assert(stacks > 1);
     assert(r > 0);
 
-    // TODO reuse recorder if sphere meshing becomes a bottleneck.
-    VertexRecorder rec;
+    // the recorder keeps its CPU storage between calls
+    static VertexRecorder rec;
+    rec.clear();
 
     float phistep = M_PIf * 2 / slices;
     float thetastep = M_PIf / stacks;
@@ -173,7 +304,8 @@ void drawCylinder(int nsides, float r, float h) {
     assert(nsides >= 3);
     float step = 2 * M_PIf / nsides;
 
-    VertexRecorder rec;
+    static VertexRecorder rec;
+    rec.clear();
     std::vector<Vector3f> pos;
     std::vector<Vector3f> n;
 
@@ -230,7 +362,8 @@ void drawCylinder(int nsides, float r, float h) {
 
 void drawQuad(float w)
 {
-    VertexRecorder rec;
+    static VertexRecorder rec;
+    rec.clear();
     float wh = w / 2;
     const Vector3f N(0, 1, 0);
     const Vector3f P1(-wh, 0, -wh);
@@ -255,7 +388,8 @@ void drawQuad(float w)
     rec.draw();
 }
 void drawUnitQuad() {
-    VertexRecorder rec;
+    static VertexRecorder rec;
+    rec.clear();
     float wh = 1;
     const Vector3f N(0, 0, 1);
     const Vector3f P1(-wh, -wh, 0);
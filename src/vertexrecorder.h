@@ -20,11 +20,21 @@ public:
     void draw(GLenum mode = GL_TRIANGLES);
     // empties the recording buffer.
     void clear();
+
+    // All recorders stream their vertices through one long-lived
+    // vertex array and ring buffer. streamedBytes() returns the number
+    // of bytes written to the ring since the last resetStreamCounter().
+    static size_t streamedBytes();
+    static void resetStreamCounter();
+    // releases the shared vertex array and ring buffer.
+    static void freeStream();
 private:
-    int m_nverts;
-    std::vector<Vector3f> m_position;
-    std::vector<Vector3f> m_normal;
-    std::vector<Vector3f> m_color;
+    struct vertex {
+        Vector3f position;
+        Vector3f normal;
+        Vector3f color;
+    };
+    std::vector<vertex> m_vertices;
 };
 
 // draw a sphere with radius r centered at (0,0,0)
@@ -0,0 +1,39 @@
+#include "workerpool.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+int workercount() {
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+void parallel_for(int n, const std::function<void(int)>& fn) {
+    int nthreads = workercount();
+    if (nthreads > n) {
+        nthreads = n;
+    }
+    if (nthreads <= 1) {
+        for (int i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++) {
+            fn(i);
+        }
+    };
+    // the calling thread works too
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; ++t) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
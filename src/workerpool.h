@@ -0,0 +1,15 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <functional>
+
+// number of threads parallel_for() runs on.
+// defaults to the number of hardware threads.
+int workercount();
+
+// calls fn(i) for every i in [0, n) on a pool of worker threads and
+// returns once all calls have finished. Work items are handed out in
+// increasing order, but may complete in any order.
+void parallel_for(int n, const std::function<void(int)>& fn);
+
+#endif